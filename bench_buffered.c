@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Benchmark for buffered_read/buffered_write/O_PREAPPEND against stdio and raw syscalls.
+// Usage: bench_buffered [max_file_mb] [directory ...]
+// Sweeps record sizes from 1 B to 16 MiB, buffer sizes and file sizes in every directory (by default
+// /dev/shm for tmpfs and the current directory for disk) and prints CSV with one row per run, with the
+// mean time per call and its p50/p99/max.
+
+// Record sizes go up by a factor of 16 from 1 B to 16 MiB
+#define BENCH_RECORD_MIN 1
+#define BENCH_RECORD_MAX ((size_t) 16 << 20)
+
+// Buffer sizes given to buffered_open_ex and setvbuf
+static const size_t buffer_sizes[] = {4 << 10, 64 << 10, 1 << 20};
+
+// Runs stop after this many calls so 1-byte records on large files finish in reasonable time
+#define BENCH_MAX_CALLS ((size_t) 1 << 20)
+
+// Amount of data prepended per O_PREAPPEND run
+#define BENCH_PREPEND_BYTES ((size_t) 1 << 20)
+
+// Calls are timed in batches of about this many bytes (at least one call each), so reading the clock
+// stays cheap next to 1-byte calls while larger calls are timed one by one
+#define BENCH_BATCH_BYTES 1024
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Latency samples of one run, each the mean time per call over a batch of calls
+typedef struct {
+    double *samples;            // Nanoseconds per call of every finished batch
+    size_t count;               // Number of samples taken
+    size_t batch;               // Calls per batch
+    size_t in_batch;            // Calls made in the current batch
+    double batch_start;         // Time the current batch started
+} latency_t;
+
+static void latency_start(latency_t *lat, double *samples, size_t record) {
+    lat->samples = samples;
+    lat->count = 0;
+    lat->batch = record < BENCH_BATCH_BYTES ? BENCH_BATCH_BYTES / record : 1;
+    lat->in_batch = 0;
+    lat->batch_start = now_seconds();
+}
+
+// Count one call, closing the batch once it is full
+static void latency_tick(latency_t *lat) {
+    if (++lat->in_batch < lat->batch)
+        return;
+    double now = now_seconds();
+    lat->samples[lat->count++] = (now - lat->batch_start) * 1e9 / (double) lat->batch;
+    lat->batch_start = now;
+    lat->in_batch = 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Sample at quantile q of the sorted samples, 0 without any
+static double latency_quantile(const latency_t *lat, double q) {
+    if (lat->count == 0)
+        return 0.0;
+    size_t index = (size_t) (q * (double) (lat->count - 1) + 0.5);
+    return lat->samples[index];
+}
+
+// Write calls records of size record with the given engine, returns the elapsed seconds or -1
+static double run_write(const char *engine, const char *path, const char *data, size_t record, size_t calls,
+                        size_t buffer_size, latency_t *lat) {
+    double start = now_seconds();
+    if (strcmp(engine, "buffered") == 0) {
+        buffered_open_options_t opts = {0};
+        opts.write_buffer_size = buffer_size;
+        buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+        if (!bf)
+            return -1;
+        for (size_t i = 0; i < calls; i++) {
+            if (buffered_write(bf, data, record) != (ssize_t) record) {
+                buffered_close(bf);
+                return -1;
+            }
+            latency_tick(lat);
+        }
+        if (buffered_close(bf) == -1)
+            return -1;
+    } else if (strcmp(engine, "stdio") == 0) {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            perror("Failed to open benchmark file");
+            return -1;
+        }
+        setvbuf(file, NULL, _IOFBF, buffer_size);
+        for (size_t i = 0; i < calls; i++) {
+            if (fwrite(data, 1, record, file) != record) {
+                perror("Failed to write benchmark file");
+                fclose(file);
+                return -1;
+            }
+            latency_tick(lat);
+        }
+        if (fclose(file) == EOF)
+            return -1;
+    } else {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("Failed to open benchmark file");
+            return -1;
+        }
+        for (size_t i = 0; i < calls; i++) {
+            if (write(fd, data, record) != (ssize_t) record) {
+                perror("Failed to write benchmark file");
+                close(fd);
+                return -1;
+            }
+            latency_tick(lat);
+        }
+        close(fd);
+    }
+    return now_seconds() - start;
+}
+
+// Read the file back in records of size record until calls records or end of file, returns the elapsed seconds or -1
+static double run_read(const char *engine, const char *path, char *data, size_t record, size_t calls,
+                       size_t buffer_size, latency_t *lat) {
+    double start = now_seconds();
+    if (strcmp(engine, "buffered") == 0) {
+        buffered_open_options_t opts = {0};
+        opts.read_buffer_size = buffer_size;
+        buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+        if (!bf)
+            return -1;
+        for (size_t i = 0; i < calls; i++) {
+            if (buffered_read(bf, data, record) <= 0)
+                break;
+            latency_tick(lat);
+        }
+        buffered_close(bf);
+    } else if (strcmp(engine, "stdio") == 0) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            perror("Failed to open benchmark file");
+            return -1;
+        }
+        setvbuf(file, NULL, _IOFBF, buffer_size);
+        for (size_t i = 0; i < calls; i++) {
+            if (fread(data, 1, record, file) == 0)
+                break;
+            latency_tick(lat);
+        }
+        fclose(file);
+    } else {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            perror("Failed to open benchmark file");
+            return -1;
+        }
+        for (size_t i = 0; i < calls; i++) {
+            if (read(fd, data, record) <= 0)
+                break;
+            latency_tick(lat);
+        }
+        close(fd);
+    }
+    return now_seconds() - start;
+}
+
+// Prepend BENCH_PREPEND_BYTES to the file in records of size record, returns the elapsed seconds or -1
+static double run_prepend(const char *path, const char *data, size_t record, size_t buffer_size, latency_t *lat) {
+    buffered_open_options_t opts = {0};
+    opts.write_buffer_size = buffer_size;
+
+    double start = now_seconds();
+    buffered_file_t *bf = buffered_open_ex(path, O_RDWR | O_PREAPPEND, 0, &opts);
+    if (!bf)
+        return -1;
+    for (size_t done = 0; done < BENCH_PREPEND_BYTES; done += record) {
+        size_t length = BENCH_PREPEND_BYTES - done < record ? BENCH_PREPEND_BYTES - done : record;
+        if (buffered_write(bf, data, length) != (ssize_t) length) {
+            buffered_close(bf);
+            return -1;
+        }
+        latency_tick(lat);
+    }
+    if (buffered_close(bf) == -1)
+        return -1;
+    return now_seconds() - start;
+}
+
+// One CSV row: throughput, mean time per call and the spread of the batch samples, where flush and
+// write-behind stalls show up in p99 and max
+static void print_row(const char *directory, const char *engine, const char *operation, size_t record,
+                      size_t buffer_size, size_t file_size, size_t bytes, size_t calls, double seconds,
+                      latency_t *lat) {
+    qsort(lat->samples, lat->count, sizeof(double), compare_doubles);
+    printf("%s,%s,%s,%zu,%zu,%zu,%zu,%zu,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f\n", directory, engine, operation, record,
+           buffer_size, file_size, bytes, calls, seconds, seconds > 0 ? (double) bytes / seconds / (1 << 20) : 0.0,
+           calls ? seconds * 1e9 / (double) calls : 0.0, latency_quantile(lat, 0.5), latency_quantile(lat, 0.99),
+           latency_quantile(lat, 1.0));
+    fflush(stdout);
+}
+
+// Every engine, buffer size and record size for one file size in one directory
+static int bench_directory(const char *directory, size_t file_size, char *data, double *samples) {
+    static const char *engines[] = {"buffered", "stdio", "raw"};
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_buffered.dat", directory);
+    latency_t lat;
+
+    for (size_t b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); b++) {
+        size_t buffer_size = buffer_sizes[b];
+        for (size_t record = BENCH_RECORD_MIN; record <= BENCH_RECORD_MAX && record <= file_size; record *= 16) {
+            size_t calls = file_size / record;
+            if (calls > BENCH_MAX_CALLS)
+                calls = BENCH_MAX_CALLS;
+            size_t bytes = calls * record;
+
+            for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+                // Raw syscalls do not depend on the buffer size, they run once
+                if (strcmp(engines[e], "raw") == 0 && b != 0)
+                    continue;
+
+                latency_start(&lat, samples, record);
+                double seconds = run_write(engines[e], path, data, record, calls, buffer_size, &lat);
+                if (seconds < 0)
+                    return -1;
+                print_row(directory, engines[e], "write", record, buffer_size, file_size, bytes, calls, seconds, &lat);
+
+                latency_start(&lat, samples, record);
+                seconds = run_read(engines[e], path, data, record, calls, buffer_size, &lat);
+                if (seconds < 0)
+                    return -1;
+                print_row(directory, engines[e], "read", record, buffer_size, file_size, bytes, calls, seconds, &lat);
+            }
+
+            // Prepending into the file just written, stdio and raw syscalls have no equivalent
+            latency_start(&lat, samples, record);
+            double seconds = run_prepend(path, data, record, buffer_size, &lat);
+            if (seconds < 0)
+                return -1;
+            size_t prepend_calls = (BENCH_PREPEND_BYTES + record - 1) / record;
+            print_row(directory, "buffered", "prepend", record, buffer_size, bytes, BENCH_PREPEND_BYTES,
+                      prepend_calls, seconds, &lat);
+        }
+    }
+
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_file_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    if (max_file_mb == 0)
+        max_file_mb = 1;
+
+    static const char *default_directories[] = {"/dev/shm", "."};
+    const char **directories = argc > 2 ? (const char **) argv + 2 : default_directories;
+    int directory_count = argc > 2 ? argc - 2 : 2;
+
+    // One sample per timed call at most, runs never make more than BENCH_MAX_CALLS calls
+    char *data = (char *)malloc(BENCH_RECORD_MAX);
+    double *samples = (double *)malloc(BENCH_MAX_CALLS * sizeof(double));
+    if (!data || !samples) {
+        perror("Failed to allocate record data");
+        free(data);
+        free(samples);
+        return 1;
+    }
+    memset(data, 'x', BENCH_RECORD_MAX);
+
+    printf("directory,engine,operation,record_bytes,buffer_bytes,file_bytes,bytes,calls,seconds,mb_per_s,ns_per_call,p50_ns,p99_ns,max_ns\n");
+    for (int d = 0; d < directory_count; d++) {
+        if (access(directories[d], W_OK) == -1) {
+            fprintf(stderr, "Skipping %s: not writable\n", directories[d]);
+            continue;
+        }
+        for (size_t file_mb = 1; file_mb <= max_file_mb; file_mb *= 8) {
+            if (bench_directory(directories[d], file_mb << 20, data, samples) == -1) {
+                free(data);
+                free(samples);
+                return 1;
+            }
+        }
+    }
+
+    free(data);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Benchmark for O_PREAPPEND: time to prepend a fixed amount of data to files of growing size.
+// Usage: bench_prepend [directory] [max_file_mb] [prepend_bytes] [record_bytes]
+// Prints CSV with one row per file size, comparing the prepend engine to the old
+// flush-every-4-KiB temp file rewrite.
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Create path holding size bytes of filler data
+static int make_file(const char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Failed to create benchmark file");
+        return -1;
+    }
+
+    char block[1 << 16];
+    memset(block, 'x', sizeof(block));
+    while (size > 0) {
+        size_t length = size < sizeof(block) ? size : sizeof(block);
+        if (write(fd, block, length) != (ssize_t) length) {
+            perror("Failed to fill benchmark file");
+            close(fd);
+            return -1;
+        }
+        size -= length;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+// The previous algorithm: every BUFFER_SIZE bytes copy the rest of the file into a temp file and back
+static int legacy_prepend(const char *path, const char *temp_path, const char *data, size_t count) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        perror("Failed to open benchmark file");
+        return -1;
+    }
+
+    char buffer[BUFFER_SIZE];
+    off_t current_pos = 0;
+    for (size_t done = 0; done < count; done += BUFFER_SIZE) {
+        size_t length = count - done < BUFFER_SIZE ? count - done : BUFFER_SIZE;
+        int temp_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (temp_fd == -1) {
+            perror("Failed to open temporary file");
+            close(fd);
+            return -1;
+        }
+
+        ssize_t read_bytes;
+        write(temp_fd, data + done, length);
+        lseek(fd, current_pos, SEEK_SET);
+        while ((read_bytes = read(fd, buffer, sizeof(buffer))) > 0)
+            write(temp_fd, buffer, read_bytes);
+
+        lseek(fd, current_pos, SEEK_SET);
+        lseek(temp_fd, 0, SEEK_SET);
+        while ((read_bytes = read(temp_fd, buffer, sizeof(buffer))) > 0)
+            write(fd, buffer, read_bytes);
+
+        close(temp_fd);
+        current_pos += (off_t) length;
+    }
+
+    unlink(temp_path);
+    close(fd);
+    return 0;
+}
+
+static int engine_prepend(const char *path, const char *data, size_t count, size_t record) {
+    buffered_file_t *bf = buffered_open(path, O_RDWR | O_PREAPPEND);
+    if (!bf)
+        return -1;
+
+    for (size_t done = 0; done < count; done += record) {
+        size_t length = count - done < record ? count - done : record;
+        if (buffered_write(bf, data + done, length) == -1) {
+            buffered_close(bf);
+            return -1;
+        }
+    }
+    return buffered_close(bf);
+}
+
+int main(int argc, char *argv[]) {
+    const char *directory = argc > 1 ? argv[1] : ".";
+    size_t max_file_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+    size_t prepend_bytes = argc > 3 ? strtoul(argv[3], NULL, 10) : 64 * 1024;
+    size_t record_bytes = argc > 4 ? strtoul(argv[4], NULL, 10) : 100;
+    if (record_bytes == 0)
+        record_bytes = 1;
+
+    char path[4096], temp_path[4096];
+    snprintf(path, sizeof(path), "%s/bench_prepend.dat", directory);
+    snprintf(temp_path, sizeof(temp_path), "%s/bench_prepend.tmp", directory);
+
+    char *data = (char *)malloc(prepend_bytes ? prepend_bytes : 1);
+    if (!data) {
+        perror("Failed to allocate prepend data");
+        return 1;
+    }
+    memset(data, 'p', prepend_bytes);
+
+    printf("file_bytes,prepend_bytes,record_bytes,engine_seconds,legacy_seconds\n");
+    for (size_t file_mb = 1; file_mb <= max_file_mb; file_mb *= 4) {
+        size_t file_size = file_mb << 20;
+
+        if (make_file(path, file_size) == -1)
+            return 1;
+        double start = now_seconds();
+        if (engine_prepend(path, data, prepend_bytes, record_bytes) == -1)
+            return 1;
+        double engine = now_seconds() - start;
+
+        if (make_file(path, file_size) == -1)
+            return 1;
+        start = now_seconds();
+        if (legacy_prepend(path, temp_path, data, prepend_bytes) == -1)
+            return 1;
+        double legacy = now_seconds() - start;
+
+        printf("%zu,%zu,%zu,%.6f,%.6f\n", file_size, prepend_bytes, record_bytes, engine, legacy);
+        fflush(stdout);
+    }
+
+    unlink(path);
+    free(data);
+    return 0;
+}
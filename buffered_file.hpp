@@ -0,0 +1,442 @@
+#ifndef BUFFERED_FILE_HPP
+#define BUFFERED_FILE_HPP
+
+// Header-only C++20 layer over buffered_open.h: an owning, move-only handle whose calls report failures
+// through std::error_code, a std::streambuf that lets iostreams use the handle's buffers directly, and a
+// handle specialized at compile time for hot paths
+
+#include "buffered_open.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ios>
+#include <span>
+#include <streambuf>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+namespace fileops {
+
+// Owns a buffered_file_t and closes it on destruction. Every call clears ec on success and sets it from
+// errno on failure. The C library still prints its own diagnostics to stderr
+class BufferedFile {
+public:
+    BufferedFile() noexcept = default;
+
+    // Take ownership of a handle opened through the C API (nullptr gives an empty object)
+    explicit BufferedFile(buffered_file_t *handle) noexcept : bf_(handle) {}
+
+    BufferedFile(const BufferedFile &) = delete;
+    BufferedFile &operator=(const BufferedFile &) = delete;
+
+    BufferedFile(BufferedFile &&other) noexcept : bf_(std::exchange(other.bf_, nullptr)) {}
+
+    BufferedFile &operator=(BufferedFile &&other) noexcept {
+        if (this != &other) {
+            reset();
+            bf_ = std::exchange(other.bf_, nullptr);
+        }
+        return *this;
+    }
+
+    // Errors on this implicit close cannot be reported, call close() to see them
+    ~BufferedFile() { reset(); }
+
+    // Open pathname like buffered_open_ex, opts may be nullptr
+    static BufferedFile open(const char *pathname, int flags, mode_t mode, std::error_code &ec,
+                             const buffered_open_options_t *opts = nullptr) noexcept {
+        errno = 0;
+        BufferedFile file(buffered_open_ex(pathname, flags, mode, opts));
+        set_error(ec, file.bf_ != nullptr);
+        return file;
+    }
+
+    static BufferedFile open(const char *pathname, int flags, std::error_code &ec) noexcept {
+        return open(pathname, flags, 0, ec);
+    }
+
+    explicit operator bool() const noexcept { return bf_ != nullptr; }
+    buffered_file_t *native_handle() const noexcept { return bf_; }
+
+    // Give up ownership without closing
+    buffered_file_t *release() noexcept { return std::exchange(bf_, nullptr); }
+
+    // Write all of data, returns the number of bytes written
+    std::size_t write(std::span<const std::byte> data, std::error_code &ec) noexcept {
+        errno = 0;
+        return result(buffered_write(bf_, data.data(), data.size()), ec);
+    }
+
+    std::size_t write(std::string_view text, std::error_code &ec) noexcept {
+        return write(std::as_bytes(std::span(text.data(), text.size())), ec);
+    }
+
+    // Read into data, returns the number of bytes read, 0 at end of file
+    std::size_t read(std::span<std::byte> data, std::error_code &ec) noexcept {
+        errno = 0;
+        return result(buffered_read(bf_, data.data(), data.size()), ec);
+    }
+
+    std::size_t pwrite(std::span<const std::byte> data, off_t offset, std::error_code &ec) noexcept {
+        errno = 0;
+        return result(buffered_pwrite(bf_, data.data(), data.size(), offset), ec);
+    }
+
+    std::size_t pread(std::span<std::byte> data, off_t offset, std::error_code &ec) noexcept {
+        errno = 0;
+        return result(buffered_pread(bf_, data.data(), data.size(), offset), ec);
+    }
+
+    // Read up to and including delim into data, see buffered_read_until
+    std::size_t read_until(int delim, std::span<std::byte> data, std::error_code &ec) noexcept {
+        errno = 0;
+        return result(buffered_read_until(bf_, delim, data.data(), data.size()), ec);
+    }
+
+    // View the next bytes without copying, see buffered_peek. The view is empty at end of file and
+    // stays valid until the next call on the handle
+    std::span<const char> peek(std::size_t want, std::error_code &ec) noexcept {
+        const char *ptr = nullptr;
+        std::size_t len = want;
+        errno = 0;
+        if (!set_error(ec, buffered_peek(bf_, &ptr, &len) == 0))
+            return {};
+        return {ptr, len};
+    }
+
+    void consume(std::size_t n, std::error_code &ec) noexcept {
+        errno = 0;
+        set_error(ec, buffered_consume(bf_, n) == 0);
+    }
+
+    off_t seek(off_t offset, int whence, std::error_code &ec) noexcept {
+        errno = 0;
+        off_t position = buffered_lseek(bf_, offset, whence);
+        set_error(ec, position != -1);
+        return position;
+    }
+
+    void flush(std::error_code &ec) noexcept {
+        errno = 0;
+        set_error(ec, buffered_flush(bf_) == 0);
+    }
+
+    void sync(std::error_code &ec) noexcept {
+        errno = 0;
+        set_error(ec, buffered_sync(bf_) == 0);
+    }
+
+    // Close the handle and report what the final flush hit, the object is empty afterwards either way
+    void close(std::error_code &ec) noexcept {
+        errno = 0;
+        set_error(ec, !bf_ || buffered_close(release()) == 0);
+    }
+
+private:
+    // Turn a C result into ec. Callers clear errno first, so a C call that failed without setting it
+    // is told apart and reported as EIO
+    static bool set_error(std::error_code &ec, bool ok) noexcept {
+        if (ok)
+            ec.clear();
+        else
+            ec.assign(errno ? errno : EIO, std::generic_category());
+        return ok;
+    }
+
+    static std::size_t result(ssize_t count, std::error_code &ec) noexcept {
+        return set_error(ec, count >= 0) ? static_cast<std::size_t>(count) : 0;
+    }
+
+    void reset() noexcept {
+        if (bf_)
+            buffered_close(std::exchange(bf_, nullptr));
+    }
+
+    buffered_file_t *bf_ = nullptr;
+};
+
+// std::streambuf over a buffered handle, without a buffer of its own. The get area is the view
+// buffered_peek returns, so extraction reads straight out of the handle's read buffer and what was
+// extracted is consumed on the next refill, seek or sync. There is no put area: every insertion goes to
+// buffered_write, which already buffers. The handle stays owned by the caller and must outlive this object
+class BufferedStreambuf : public std::streambuf {
+public:
+    explicit BufferedStreambuf(buffered_file_t *handle) noexcept : bf_(handle) {}
+    explicit BufferedStreambuf(BufferedFile &file) noexcept : bf_(file.native_handle()) {}
+
+    BufferedStreambuf(const BufferedStreambuf &) = delete;
+    BufferedStreambuf &operator=(const BufferedStreambuf &) = delete;
+
+    // Extracted bytes are handed back to the handle so it continues where the stream stopped
+    ~BufferedStreambuf() override { settle(); }
+
+protected:
+    int_type underflow() override {
+        if (!settle())
+            return traits_type::eof();
+        const char *ptr = nullptr;
+        std::size_t len = 0;
+        if (buffered_peek(bf_, &ptr, &len) == -1 || len == 0)
+            return traits_type::eof();
+
+        // The view is read-only, the get area never writes through its pointers (putback stays within it)
+        char *view = const_cast<char *>(ptr);
+        setg(view, view, view + len);
+        return traits_type::to_int_type(*view);
+    }
+
+    std::streamsize xsputn(const char_type *s, std::streamsize n) override {
+        if (!settle())
+            return 0;
+        ssize_t written = buffered_write(bf_, s, static_cast<std::size_t>(n));
+        return written < 0 ? 0 : written;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        char_type ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        if (!settle())
+            return pos_type(off_type(-1));
+        int whence = dir == std::ios_base::beg ? SEEK_SET : dir == std::ios_base::cur ? SEEK_CUR : SEEK_END;
+        return pos_type(off_type(buffered_lseek(bf_, static_cast<off_t>(off), whence)));
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+    int sync() override {
+        if (!settle())
+            return -1;
+        return buffered_flush(bf_) == 0 ? 0 : -1;
+    }
+
+private:
+    // Consume what was extracted from the current view and drop the view, which the next call on the
+    // handle invalidates
+    bool settle() noexcept {
+        if (!eback())
+            return true;
+        std::size_t extracted = static_cast<std::size_t>(gptr() - eback());
+        setg(nullptr, nullptr, nullptr);
+        return extracted == 0 || buffered_consume(bf_, extracted) == 0;
+    }
+
+    buffered_file_t *bf_;
+};
+
+// Access modes of StaticBufferedFile, fixed at compile time
+enum class Access { ReadOnly, WriteOnly, Prepend };
+
+// Durability policies of StaticBufferedFile, the BUFFER_DURABILITY_* values as a type-safe parameter
+enum class Durability {
+    None = BUFFER_DURABILITY_NONE,
+    Flush = BUFFER_DURABILITY_FLUSH,
+    Group = BUFFER_DURABILITY_GROUP,
+    Writeback = BUFFER_DURABILITY_WRITEBACK,
+};
+
+// Buffered file specialized at compile time on its buffer size, access mode and durability policy, for
+// hot paths making very many small calls. The buffer lives inline in the object, and write and read are
+// a bounds check and a memcpy that the compiler can inline. Calls the mode does not allow do not compile.
+// Only a full or flushed buffer reaches the C library, in one piece at least as large as the C handle's own
+// buffers, so the C handle passes it straight through (or queues it, for Prepend) without copying it again.
+// Durability, checksums, statistics and prefix logs all still come from the C handle, and so only cover
+// bytes once they have left the inline buffer: a group commit period starts counting them from there
+template <std::size_t BufferSize, Access Mode, Durability Policy = Durability::None>
+class StaticBufferedFile {
+    static_assert(BufferSize > 0, "the buffer needs room for at least one byte");
+    static_assert(Mode != Access::ReadOnly || Policy == Durability::None, "durability only applies to writers");
+
+    static constexpr bool writer = Mode != Access::ReadOnly;
+
+public:
+    StaticBufferedFile() noexcept = default;
+
+    StaticBufferedFile(const StaticBufferedFile &) = delete;
+    StaticBufferedFile &operator=(const StaticBufferedFile &) = delete;
+
+    // Moving carries the buffered bytes over, the buffer being part of the object
+    StaticBufferedFile(StaticBufferedFile &&other) noexcept { take(other); }
+
+    StaticBufferedFile &operator=(StaticBufferedFile &&other) noexcept {
+        if (this != &other) {
+            std::error_code ignored;
+            close(ignored);
+            take(other);
+        }
+        return *this;
+    }
+
+    // Errors on this implicit flush and close cannot be reported, call close() to see them
+    ~StaticBufferedFile() {
+        std::error_code ignored;
+        close(ignored);
+    }
+
+    // Open pathname in the template's mode. flags adds open flags such as O_CREAT, O_TRUNC or O_APPEND,
+    // opts may give the other buffered_open_options_t settings (its buffer sizes and durability are replaced).
+    // The C handle never sees the inline buffer, so its flush timer and write-behind flusher could not reach
+    // it: flush_latency_us and write_behind_buffers fail with EINVAL
+    static StaticBufferedFile open(const char *pathname, int flags, mode_t mode, std::error_code &ec,
+                                   const buffered_open_options_t *opts = nullptr) noexcept {
+        buffered_open_options_t options{};
+        if (opts)
+            options = *opts;
+        if (options.flush_latency_us != 0 || options.write_behind_buffers > 1) {
+            ec.assign(EINVAL, std::generic_category());
+            return {};
+        }
+        // One-byte C buffers: every piece handed over is larger, so none of it is copied there
+        options.read_buffer_size = 1;
+        options.write_buffer_size = 1;
+        options.auto_size = 0;
+        options.durability = static_cast<int>(Policy);
+
+        // In-place and atomic prepends read the file back, prefix logs only append and refuse O_RDWR
+        int access = Mode == Access::ReadOnly    ? O_RDONLY
+                     : Mode == Access::WriteOnly ? O_WRONLY
+                     : options.prepend_log       ? O_WRONLY | O_PREAPPEND
+                                                 : O_RDWR | O_PREAPPEND;
+        StaticBufferedFile file;
+        file.file_ = BufferedFile::open(pathname, (flags & ~O_ACCMODE) | access, mode, ec, &options);
+        return file;
+    }
+
+    explicit operator bool() const noexcept { return static_cast<bool>(file_); }
+    buffered_file_t *native_handle() const noexcept { return file_.native_handle(); }
+
+    std::size_t write(std::span<const std::byte> data, std::error_code &ec) noexcept
+        requires writer
+    {
+        if (data.size() <= BufferSize - pos_) [[likely]] {
+            std::memcpy(buffer_ + pos_, data.data(), data.size());
+            pos_ += data.size();
+            ec.clear();
+            return data.size();
+        }
+        return write_slow(data, ec);
+    }
+
+    std::size_t write(std::string_view text, std::error_code &ec) noexcept
+        requires writer
+    {
+        return write(std::as_bytes(std::span(text.data(), text.size())), ec);
+    }
+
+    // Read into data, returns the number of bytes read, 0 at end of file
+    std::size_t read(std::span<std::byte> data, std::error_code &ec) noexcept
+        requires(!writer)
+    {
+        if (data.size() <= end_ - pos_) [[likely]] {
+            std::memcpy(data.data(), buffer_ + pos_, data.size());
+            pos_ += data.size();
+            ec.clear();
+            return data.size();
+        }
+        return read_slow(data, ec);
+    }
+
+    // Hand the buffer to the C handle and flush it, which applies the durability policy
+    void flush(std::error_code &ec) noexcept
+        requires writer
+    {
+        if (drain(ec))
+            file_.flush(ec);
+    }
+
+    void sync(std::error_code &ec) noexcept
+        requires writer
+    {
+        if (drain(ec))
+            file_.sync(ec);
+    }
+
+    // Flush what is buffered and close, the object is empty afterwards either way
+    void close(std::error_code &ec) noexcept {
+        ec.clear();
+        if (!file_)
+            return;
+        if constexpr (writer)
+            drain(ec);
+        std::error_code closed;
+        file_.close(closed);
+        if (!ec)
+            ec = closed;
+        pos_ = end_ = 0;
+    }
+
+private:
+    // Write the buffered bytes and data in one call, or flush and start over in the buffer when data is small
+    std::size_t write_slow(std::span<const std::byte> data, std::error_code &ec) noexcept {
+        if (data.size() < BufferSize) {
+            if (!drain(ec))
+                return 0;
+            std::memcpy(buffer_, data.data(), data.size());
+            pos_ = data.size();
+            return data.size();
+        }
+
+        struct iovec iov[2] = { { buffer_, pos_ }, { const_cast<std::byte *>(data.data()), data.size() } };
+        errno = 0;
+        if (buffered_writev(file_.native_handle(), iov + (pos_ == 0), 2 - (pos_ == 0)) < 0) {
+            ec.assign(errno ? errno : EIO, std::generic_category());
+            return 0;
+        }
+        pos_ = 0;
+        ec.clear();
+        return data.size();
+    }
+
+    // Serve what is buffered, then read large remainders straight into data and small ones through the buffer
+    std::size_t read_slow(std::span<std::byte> data, std::error_code &ec) noexcept {
+        std::size_t done = end_ - pos_;
+        std::memcpy(data.data(), buffer_ + pos_, done);
+        pos_ = end_ = 0;
+        ec.clear();
+
+        std::size_t rest = data.size() - done;
+        if (rest >= BufferSize)
+            return done + file_.read(data.subspan(done), ec);
+
+        std::size_t loaded = file_.read(std::span<std::byte>(buffer_, BufferSize), ec);
+        std::size_t copied = loaded < rest ? loaded : rest;
+        std::memcpy(data.data() + done, buffer_, copied);
+        pos_ = copied;
+        end_ = loaded;
+        return done + copied;
+    }
+
+    // Give the buffered bytes to the C handle
+    bool drain(std::error_code &ec) noexcept {
+        ec.clear();
+        if (pos_ == 0)
+            return true;
+        file_.write(std::span<const std::byte>(buffer_, pos_), ec);
+        pos_ = 0;
+        return !ec;
+    }
+
+    void take(StaticBufferedFile &other) noexcept {
+        file_ = std::move(other.file_);
+        std::memcpy(buffer_, other.buffer_ + (writer ? 0 : other.pos_), writer ? other.pos_ : other.end_ - other.pos_);
+        pos_ = writer ? other.pos_ : 0;
+        end_ = writer ? 0 : other.end_ - other.pos_;
+        other.pos_ = other.end_ = 0;
+    }
+
+    BufferedFile file_;
+    std::size_t pos_ = 0;       // Writers: bytes buffered. Readers: next byte to return
+    std::size_t end_ = 0;       // Readers: end of the data loaded into the buffer
+    alignas(64) std::byte buffer_[BufferSize];
+};
+
+} // namespace fileops
+
+#endif // BUFFERED_FILE_HPP
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "buffered_open.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,236 +6,3915 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <float.h>
 
-#define BUFFER_SIZE 4096
+// Helper function to allocate and initialize a buffered_file_t structure
+size_t min(size_t a, size_t b) {
+    if (a < b)
+        return a;
+    return b;
+}
+
+static void writer_start(buffered_file_t *bf, int count);
+static int flush_handle(buffered_file_t *bf);
+static int prefix_log_load(const char *pathname, int fd, char **prefix, size_t *prefix_length, uint64_t *generation,
+                           size_t *valid);
+static int prefix_log_attach(buffered_file_t *bf, const char *pathname, uint64_t generation, size_t valid);
+static int prefix_log_append(buffered_file_t *bf);
+static int prefix_log_remove(const char *pathname);
+static int atomic_insert_into_file(buffered_file_t *bf, off_t offset, const void *buf, size_t count);
+static int cache_open_file(const struct stat *st);
+static void cache_identify(buffered_file_t *bf, const struct stat *st);
+static void cache_written(buffered_file_t *bf);
+static int autoflush_start(buffered_file_t *bf, unsigned latency_us);
+
+// perror that leaves errno alone, so callers still see why the call failed after the message is printed
+static void report_error(const char *message) {
+    int saved = errno;
+    perror(message);
+    errno = saved;
+}
+
+// Count into a handle's statistics, handles opened without them skip this with one branch
+#define STAT_ADD(stats, field, n) \
+    do { \
+        if (stats) \
+            __atomic_fetch_add(&(stats)->field, (uint64_t) (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+// Monotonic time in nanoseconds
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Clock for flush latencies, only read when statistics are kept
+static uint64_t stats_clock(buffered_stats_t *stats) {
+    return stats ? monotonic_ns() : 0;
+}
+
+// Record a flush that began at started in the log2 latency histogram
+static void stats_flush(buffered_stats_t *stats, uint64_t started) {
+    if (!stats)
+        return;
+    uint64_t micros = (stats_clock(stats) - started) / 1000;
+    int bucket = micros ? 64 - __builtin_clzll(micros) : 0;
+    if (bucket >= BUFFER_LATENCY_BUCKETS)
+        bucket = BUFFER_LATENCY_BUCKETS - 1;
+    STAT_ADD(stats, flushes, 1);
+    STAT_ADD(stats, flush_latency[bucket], 1);
+}
+
+// Syscalls made so far, compared after an entry point to tell calls the buffers absorbed
+static uint64_t stats_begin(buffered_stats_t *stats) {
+    if (!stats)
+        return 0;
+    return __atomic_load_n(&stats->read_syscalls, __ATOMIC_RELAXED) +
+           __atomic_load_n(&stats->write_syscalls, __ATOMIC_RELAXED) +
+           __atomic_load_n(&stats->seek_syscalls, __ATOMIC_RELAXED);
+}
+
+// Account for one read (writing == 0) or write entry point call that asked for requested bytes
+static void stats_end(buffered_stats_t *stats, int writing, uint64_t syscalls, size_t requested) {
+    if (!stats)
+        return;
+    int buffered = stats_begin(stats) == syscalls;
+    if (writing) {
+        STAT_ADD(stats, write_calls, 1);
+        STAT_ADD(stats, write_calls_buffered, buffered);
+        STAT_ADD(stats, bytes_written, requested);
+    } else {
+        STAT_ADD(stats, read_calls, 1);
+        STAT_ADD(stats, read_calls_buffered, buffered);
+        STAT_ADD(stats, bytes_read, requested);
+    }
+}
+
+// CRC32C (Castagnoli) kernels for checksumming handles, picked once at runtime from what the CPU supports.
+// They work on the raw register, the caller starts from and finishes with ~0
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *data, size_t length);
+
+// Slicing-by-8 tables for CPUs without a CRC32C instruction, built on first use
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++)
+            crc32c_table[slice][i] = (crc32c_table[slice - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[slice - 1][i] & 0xff];
+    }
+}
+
+static uint32_t crc32c_table_update(uint32_t crc, const unsigned char *data, size_t length) {
+    pthread_once(&crc32c_table_once, crc32c_build_table);
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+              crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xff] ^ crc32c_table[2][(high >> 8) & 0xff] ^
+              crc32c_table[1][(high >> 16) & 0xff] ^ crc32c_table[0][high >> 24];
+    }
+    while (length--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+// Building with BUFFER_CRC32C_TABLE leaves out the hardware kernel, so the table one can be tested on
+// CPUs that have the instruction
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(BUFFER_CRC32C_TABLE)
+#define BUFFER_CRC32C_SSE42 1
+#include <immintrin.h>
+
+// SSE4.2 crc32 instruction, a word at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_update(uint32_t crc, const unsigned char *data, size_t length) {
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; length >= 4; data += 4, length -= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+static crc32c_fn crc32c_impl;
+
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) {
+    crc32c_fn impl = __atomic_load_n(&crc32c_impl, __ATOMIC_RELAXED);
+    if (!impl) {
+        impl = crc32c_table_update;
+#ifdef BUFFER_CRC32C_SSE42
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+            impl = crc32c_sse42_update;
+#endif
+        __atomic_store_n(&crc32c_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl(crc, (const unsigned char *) data, length);
+}
+
+// Fold bytes the caller wrote or read into the handle's running checksum
+static void checksum_update(buffered_file_t *bf, const void *data, size_t length) {
+    if (bf->checksum)
+        bf->checksum_state = crc32c_update(bf->checksum_state, data, length);
+}
+
+// checksum_update for the first count bytes described by an iovec array
+static void checksum_update_iov(buffered_file_t *bf, const struct iovec *iov, int iovcnt, size_t count) {
+    for (int i = 0; bf->checksum && i < iovcnt && count > 0; i++) {
+        size_t length = min(iov[i].iov_len, count);
+        checksum_update(bf, iov[i].iov_base, length);
+        count -= length;
+    }
+}
+
+// fdatasync the file and start a new group commit period
+static int sync_handle(buffered_file_t *bf) {
+    STAT_ADD(bf->stats, syncs, 1);
+    if (fdatasync(bf->prefix_log ? bf->prefix_fd : bf->fd) == -1) {
+        report_error("Failed to sync file");
+        return -1;
+    }
+    bf->sync_pending = 0;
+    bf->sync_last = monotonic_ns();
+    return 0;
+}
+
+// The part of the durability policy that keeps no state, so the write-behind flusher can apply it to
+// its own writes: the shared block cache learns the file changed, and writeback hints start the I/O
+static void durability_started(buffered_file_t *bf, off_t offset, size_t length) {
+    // Whatever the policy, the shared block cache no longer holds the file as it is
+    cache_written(bf);
+
+    // A range of 0 bytes from offset 0 covers the whole file
+    if (bf->durability == BUFFER_DURABILITY_WRITEBACK && length != 0)
+        sync_file_range(bf->prefix_log ? bf->prefix_fd : bf->fd, offset == -1 ? 0 : offset, offset == -1 ? 0 : (off_t) length, SYNC_FILE_RANGE_WRITE);
+}
+
+// Count length bytes towards the next fdatasync, syncing when the group commit period is over. Only
+// the thread making the handle's calls, or the timer holding its lock, keeps this account
+static int durability_account(buffered_file_t *bf, size_t length) {
+    if ((bf->durability != BUFFER_DURABILITY_FLUSH && bf->durability != BUFFER_DURABILITY_GROUP) || length == 0)
+        return 0;
+
+    bf->sync_pending += length;
+    if (bf->durability == BUFFER_DURABILITY_GROUP &&
+        ((bf->sync_bytes && bf->sync_pending >= bf->sync_bytes) ||
+         (bf->sync_interval && monotonic_ns() - bf->sync_last >= bf->sync_interval)))
+        return sync_handle(bf);
+    return 0;
+}
+
+// Apply the durability policy to length bytes just handed to the kernel at offset, -1 when the data
+// has no fixed place yet (O_APPEND writes, prepend inserts that moved the tail)
+static int durability_written(buffered_file_t *bf, off_t offset, size_t length) {
+    durability_started(bf, offset, length);
+    return durability_account(bf, length);
+}
+
+// durability_written for bytes a write has already stored and will report as written. A failed sync
+// is kept in sync_error and returned by the next flush instead of hiding the count
+static void durability_deferred(buffered_file_t *bf, off_t offset, size_t length) {
+    if (durability_written(bf, offset, length) == -1 && bf->sync_error == 0)
+        bf->sync_error = errno;
+}
+
+// Hand a sync failure kept by durability_deferred to the flush that owes it
+static int durability_owed(buffered_file_t *bf) {
+    if (bf->sync_error == 0)
+        return 0;
+    errno = bf->sync_error;
+    bf->sync_error = 0;
+    return -1;
+}
+
+// Offset the write buffer's data lands at, -1 when O_APPEND puts it at the end of the file
+static off_t write_buffer_offset(buffered_file_t *bf) {
+    return bf->flags & O_APPEND ? -1 : bf->file_offset;
+}
+
+// Round size up to a multiple of block (block must be non-zero)
+static size_t round_up(size_t size, size_t block) {
+    return (size + block - 1) / block * block;
+}
+
+// The fd offset, asking the kernel only when O_APPEND writes have made the tracked value unknown
+static off_t current_file_offset(buffered_file_t *bf) {
+    if (bf->file_offset == -1) {
+        STAT_ADD(bf->stats, seek_syscalls, 1);
+        bf->file_offset = lseek(bf->fd, 0, SEEK_CUR);
+    }
+    return bf->file_offset;
+}
+
+// Pick read and write buffer capacities from the file's preferred block size and its length
+static void auto_size_buffers(int fd, size_t *read_size, size_t *write_size) {
+    struct stat st;
+    size_t block = BUFFER_SIZE;
+    size_t file_size = 0;
+
+    if (fstat(fd, &st) == 0) {
+        if (st.st_blksize > 0)
+            block = (size_t) st.st_blksize;
+        if (S_ISREG(st.st_mode) && st.st_size > 0)
+            file_size = (size_t) st.st_size;
+    }
+
+    size_t limit = BUFFER_AUTO_MAX < block ? block : BUFFER_AUTO_MAX;
+
+    // Reads want the whole file in one syscall when it is small, and the cap when it is large
+    if (*read_size == 0) {
+        *read_size = file_size ? min(round_up(file_size, block), limit) : block;
+    }
+
+    // Writes start at a batch of blocks and grow with the file they are appended to
+    if (*write_size == 0) {
+        size_t batch = block * BUFFER_AUTO_BLOCKS;
+        if (file_size > batch)
+            batch = round_up(file_size, block);
+        *write_size = min(batch, limit);
+    }
+}
+
+buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+
+    va_list args;
+    va_start(args, flags);
+    if (flags & O_CREAT) {
+        mode = va_arg(args, int);
+    }
+    va_end(args);
+
+    return buffered_open_ex(pathname, flags, mode, NULL);
+}
+
+// Handles and their buffers start on cache line boundaries
+#define HANDLE_ALIGNMENT 64
+
+// Point the handle at buffers laid out right after it in the same block
+static void attach_buffers(buffered_file_t *bf, size_t read_size, size_t write_size, size_t alignment) {
+    char *block = (char *) bf + round_up(sizeof(buffered_file_t), alignment);
+    bf->read_buffer = read_size ? block : NULL;
+    bf->read_buffer_capacity = read_size;
+    bf->write_buffer = write_size ? block + round_up(read_size, alignment) : NULL;
+    bf->write_buffer_size = write_size;
+}
+
+// One allocation holds the handle followed by its buffers, all starting on alignment boundaries
+// (a cache line normally, the device's block size for O_DIRECT)
+static buffered_file_t *allocate_handle(size_t read_size, size_t write_size, size_t alignment) {
+    size_t total = round_up(sizeof(buffered_file_t), alignment) +
+                   round_up(read_size, alignment) + round_up(write_size, alignment);
+    void *block;
+    if (posix_memalign(&block, alignment, total) != 0)
+        return NULL;
+
+    buffered_file_t *bf = (buffered_file_t *) block;
+    memset(bf, 0, sizeof(buffered_file_t));
+    attach_buffers(bf, read_size, write_size, alignment);
+    return bf;
+}
+
+// Give the read buffer room for needed bytes, keeping what it holds. The buffer that came with the
+// handle stays part of its block, only the data moves out
+static int grow_read_buffer(buffered_file_t *bf, size_t needed) {
+    void *new_buffer = NULL;
+    if (posix_memalign(&new_buffer, bf->direct_align ? bf->direct_align : HANDLE_ALIGNMENT, needed) != 0) {
+        report_error("Failed to grow read buffer");
+        return -1;
+    }
+    memcpy(new_buffer, bf->read_buffer, bf->read_buffer_size);
+    if (bf->read_buffer_heap)
+        free(bf->read_buffer);
+    bf->read_buffer = (char *) new_buffer;
+    bf->read_buffer_capacity = needed;
+    bf->read_buffer_heap = 1;
+    return 0;
+}
+
+// Alignment O_DIRECT transfers on fd need, from statx where the kernel reports it
+static size_t direct_alignment(int fd) {
+    size_t alignment = BUFFER_SIZE;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+        stx.stx_dio_offset_align != 0) {
+        alignment = stx.stx_dio_offset_align;
+        if (stx.stx_dio_mem_align > alignment)
+            alignment = stx.stx_dio_mem_align;
+    }
+#endif
+    return alignment;
+}
+
+// Pool of idle handle blocks. Every block carries buffers of the pool's sizes so it can serve any
+// open mode, and closing a pooled handle puts its block back instead of freeing it
+struct buffered_pool {
+    pthread_mutex_t lock;
+    buffered_open_options_t opts;   // Options every handle opened from the pool uses
+    buffered_file_t **idle;         // Blocks waiting to be reused
+    size_t idle_count;              // Number of blocks in idle
+    size_t max_idle;                // Most blocks kept around, the rest are freed on close
+    size_t open_handles;            // Handles currently opened from the pool
+    int destroyed;                  // Set by buffered_pool_destroy, the last handle to close frees the pool
+};
+
+buffered_pool_t *buffered_pool_create(size_t max_handles, const buffered_open_options_t *opts) {
+    buffered_pool_t *pool = (buffered_pool_t *)calloc(1, sizeof(buffered_pool_t));
+    if (!pool) {
+        report_error("Failed to allocate memory for buffered_pool_t");
+        return NULL;
+    }
+    pool->idle = (buffered_file_t **)calloc(max_handles ? max_handles : 1, sizeof(buffered_file_t *));
+    if (!pool->idle) {
+        report_error("Failed to allocate memory for buffered_pool_t");
+        free(pool);
+        return NULL;
+    }
+
+    // Pooled blocks are shared between files, so their buffer sizes are fixed up front
+    if (opts)
+        pool->opts = *opts;
+    pool->opts.auto_size = 0;
+    if (pool->opts.read_buffer_size == 0)
+        pool->opts.read_buffer_size = BUFFER_SIZE;
+    if (pool->opts.write_buffer_size == 0)
+        pool->opts.write_buffer_size = BUFFER_SIZE;
+    pool->max_idle = max_handles;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+static void pool_free(buffered_pool_t *pool) {
+    for (size_t i = 0; i < pool->idle_count; i++)
+        free(pool->idle[i]);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool);
+}
+
+void buffered_pool_destroy(buffered_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->destroyed = 1;
+    int unused = pool->open_handles == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (unused)
+        pool_free(pool);
+}
+
+static buffered_file_t *pool_acquire(buffered_pool_t *pool) {
+    buffered_file_t *bf = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count > 0)
+        bf = pool->idle[--pool->idle_count];
+    pool->open_handles++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (bf) {
+        memset(bf, 0, sizeof(buffered_file_t));
+        attach_buffers(bf, pool->opts.read_buffer_size, pool->opts.write_buffer_size, HANDLE_ALIGNMENT);
+    } else {
+        bf = allocate_handle(pool->opts.read_buffer_size, pool->opts.write_buffer_size, HANDLE_ALIGNMENT);
+    }
+
+    if (!bf) {
+        pthread_mutex_lock(&pool->lock);
+        pool->open_handles--;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    bf->pool = pool;
+    return bf;
+}
+
+// Give a handle's block back to its pool, or to the allocator when the pool is full or gone
+static void release_handle(buffered_file_t *bf) {
+    buffered_pool_t *pool = bf->pool;
+    if (!pool) {
+        free(bf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->open_handles--;
+    if (!pool->destroyed && pool->idle_count < pool->max_idle) {
+        pool->idle[pool->idle_count++] = bf;
+        bf = NULL;
+    }
+    int unused = pool->destroyed && pool->open_handles == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    free(bf);
+    if (unused)
+        pool_free(pool);
+}
+
+static buffered_file_t *open_handle(buffered_pool_t *pool, const char *pathname, int flags, mode_t mode,
+                                    const buffered_open_options_t *opts) {
+    int preappend = (flags & O_PREAPPEND) != 0;
+
+    // Mapping only replaces reads, so it is honoured on plain read-only handles
+    int mmap_mode = (flags & O_MMAP) && (flags & O_ACCMODE) == O_RDONLY && !preappend;
+
+    // Remove O_PREAPPEND and O_MMAP before calling the original open function
+    int open_flags = flags & ~(O_PREAPPEND | O_MMAP);
+
+    // O_DIRECT writes read back the partial blocks they rewrite, so write-only direct handles get a
+    // read-write fd. The handle's flags keep the caller's access mode, which is what the calls check
+    if ((open_flags & O_DIRECT) && (open_flags & O_ACCMODE) == O_WRONLY)
+        open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+
+    int fd;
+    if (open_flags & O_CREAT) {
+        fd = open(pathname, open_flags, mode);
+    } else {
+        fd = open(pathname, open_flags);
+    }
+
+    // A file the caller may only write cannot be read back, it gets a page-cached write-only handle
+    if (fd == -1 && errno == EACCES && (open_flags & O_ACCMODE) != (flags & O_ACCMODE)) {
+        open_flags = (open_flags & ~(O_ACCMODE | O_DIRECT)) | O_WRONLY;
+        flags &= ~O_DIRECT;
+        fd = open(pathname, open_flags, mode);
+    }
+
+    // Filesystems that refuse O_DIRECT still get a working, page-cached handle
+    if (fd == -1 && errno == EINVAL && (open_flags & O_DIRECT)) {
+        open_flags &= ~O_DIRECT;
+        flags &= ~O_DIRECT;
+        fd = open(pathname, open_flags, mode);
+    }
+
+    if (fd == -1) {
+        report_error("Failed to open file");
+        return NULL;
+    }
+
+    // Only handles opened with prepend_log look for a prefix log. Read-only ones show the logical file,
+    // with the log's data in front of the file's own, and O_PREAPPEND ones append to the log
+    char *prefix = NULL;
+    size_t prefix_length = 0, log_valid = 0;
+    uint64_t generation = 0;
+    int prefix_log = preappend && opts && opts->prepend_log;
+    if (opts && opts->prepend_log) {
+        // A read-write handle would read the file's own bytes while prepends go to the log
+        if ((flags & O_ACCMODE) == O_RDWR) {
+            errno = EINVAL;
+            report_error("Prefix log handles must be read-only or write-only");
+            close(fd);
+            return NULL;
+        }
+        // Plain writers would address the file's own bytes at offsets that no longer match the logical
+        // file. Truncating drops the log, after which the two agree again
+        if ((flags & O_ACCMODE) == O_WRONLY && !preappend && !(open_flags & O_TRUNC)) {
+            errno = EINVAL;
+            report_error("Prefix log writers must prepend or truncate");
+            close(fd);
+            return NULL;
+        }
+        if (prefix_log_load(pathname, fd, (flags & O_ACCMODE) == O_RDONLY ? &prefix : NULL, &prefix_length,
+                            &generation, &log_valid) == -1) {
+            report_error("Failed to read prefix log");
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // Truncating the file also drops whatever was prepended to it, the log is removed only once its
+    // header shows it belongs to this file
+    if ((open_flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && log_valid != 0) {
+        if (prefix_log_remove(pathname) == -1) {
+            report_error("Failed to remove prefix log");
+            close(fd);
+            return NULL;
+        }
+        log_valid = 0;
+        generation = 0;
+    }
+
+    // The prefix is served from memory in front of the file, which mapping and O_DIRECT do not allow for
+    if (prefix_length != 0)
+        mmap_mode = 0;
+
+    // O_DIRECT is handled for plain streaming handles. Prepending, mapping, O_APPEND and pooled
+    // handles go back to the page cache, Linux allows dropping the flag on an open fd
+    size_t alignment = HANDLE_ALIGNMENT;
+    int direct = (flags & O_DIRECT) && !preappend && !mmap_mode && !pool && !(flags & O_APPEND) && prefix_length == 0;
+    if (direct) {
+        alignment = direct_alignment(fd);
+    } else if (flags & O_DIRECT) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        flags &= ~O_DIRECT;
+    }
+
+    // Read-write handles on regular files keep one shared window, so reads see pending writes without a
+    // flush. Write-behind, O_APPEND and the special modes keep separate buffers
+    int coherent = (flags & O_ACCMODE) == O_RDWR && !(flags & O_APPEND) && !preappend && !mmap_mode &&
+                   !direct && !(opts && opts->write_behind_buffers > 1);
+
+    // Handles reading through the block cache read at tracked offsets like coherent ones, so plain
+    // read-only handles that opt in get the same window, which they never write to
+    int block_cache = opts && opts->block_cache &&
+                      (coherent || ((flags & O_ACCMODE) == O_RDONLY && !mmap_mode && !direct && prefix_length == 0));
+
+    // Writable handles learn which file they have open, their writes drop its blocks from the cache
+    struct stat st;
+    int regular = 0;
+    if ((coherent || block_cache || (flags & O_ACCMODE) != O_RDONLY) && fstat(fd, &st) == 0)
+        regular = S_ISREG(st.st_mode);
+    block_cache = block_cache && regular;
+    coherent = (coherent || block_cache) && regular;
+    if (block_cache && cache_open_file(&st) == -1) {
+        report_error("Failed to start block cache");
+        free(prefix);
+        close(fd);
+        return NULL;
+    }
+
+    buffered_file_t *bf;
+    if (pool) {
+        bf = pool_acquire(pool);
+    } else {
+        size_t read_size = opts ? opts->read_buffer_size : 0;
+        size_t write_size = opts ? opts->write_buffer_size : 0;
+        if (opts && opts->auto_size) {
+            auto_size_buffers(fd, &read_size, &write_size);
+        }
+        if (read_size == 0)
+            read_size = BUFFER_SIZE;
+        if (write_size == 0)
+            write_size = BUFFER_SIZE;
+
+        // Only allocate the buffers this handle can actually use
+        if ((flags & O_ACCMODE) == O_WRONLY || mmap_mode)
+            read_size = 0;
+        if ((flags & O_ACCMODE) == O_RDONLY || preappend)
+            write_size = 0;
+
+        // The shared window is the read buffer, sized for whichever direction asked for more
+        if (coherent) {
+            read_size = read_size > write_size ? read_size : write_size;
+            write_size = 0;
+        }
+
+        // Direct transfers move whole blocks in and out of the buffers
+        if (direct) {
+            read_size = round_up(read_size, alignment);
+            write_size = round_up(write_size, alignment);
+        }
+        bf = allocate_handle(read_size, write_size, alignment);
+    }
+
+    if (!bf) {
+        report_error("Failed to allocate memory for buffered_file_t");
+        free(prefix);
+        close(fd);
+        return NULL;
+    }
+
+    bf->fd = fd;
+    bf->flags = flags;
+    bf->preappend = preappend;
+    bf->mmap_mode = mmap_mode;
+    bf->prepend_atomic = preappend && opts && opts->prepend_atomic;
+    bf->read_regular = -1;
+    bf->direct_align = direct ? alignment : 0;
+    if (coherent) {
+        bf->coherent = 1;
+        bf->read_regular = 1;
+        bf->read_file_size = st.st_size;
+    }
+    if (regular) {
+        cache_identify(bf, &st);
+        bf->block_cache = block_cache;
+    }
+    // Truncating through open is a write like any other as far as cached blocks go
+    if (open_flags & O_TRUNC)
+        cache_written(bf);
+    if (opts && opts->durability) {
+        bf->durability = opts->durability;
+        bf->sync_bytes = opts->sync_bytes;
+        bf->sync_interval = (uint64_t) opts->sync_interval_ms * 1000000u;
+        if (bf->durability == BUFFER_DURABILITY_GROUP && !bf->sync_bytes && !bf->sync_interval)
+            bf->sync_interval = (uint64_t) BUFFER_SYNC_INTERVAL_MS * 1000000u;
+        bf->sync_last = monotonic_ns();
+    }
+    if (opts && opts->checksum) {
+        bf->checksum = 1;
+        bf->checksum_state = ~0u;
+    }
+    if (opts && opts->stats && !(bf->stats = (buffered_stats_t *)calloc(1, sizeof(buffered_stats_t)))) {
+        report_error("Failed to allocate memory for statistics");
+        buffered_close(bf);
+        return NULL;
+    }
+    // The flusher counts into the statistics and applies the durability policy, both are set up by now
+    if ((flags & O_ACCMODE) != O_RDONLY && !preappend && !direct && opts && opts->write_behind_buffers > 1) {
+        writer_start(bf, opts->write_behind_buffers);
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY && opts &&
+        (opts->flush_latency_us || (bf->durability == BUFFER_DURABILITY_GROUP && bf->sync_interval)) &&
+        autoflush_start(bf, opts->flush_latency_us) == -1) {
+        report_error("Failed to start auto-flush timer");
+        buffered_close(bf);
+        return NULL;
+    }
+    if (prefix_length != 0) {
+        // The prefix sits in the read window at base file offsets [-prefix_length, 0)
+        bf->prefix_data = prefix;
+        bf->prefix_length = prefix_length;
+        if (prefix_length > bf->read_buffer_capacity && grow_read_buffer(bf, prefix_length) == -1) {
+            buffered_close(bf);
+            return NULL;
+        }
+        memcpy(bf->read_buffer, prefix, prefix_length);
+        bf->read_buffer_size = prefix_length;
+    }
+    if (prefix_log && prefix_log_attach(bf, pathname, generation, log_valid) == -1) {
+        buffered_close(bf);
+        return NULL;
+    }
+    if (bf->prepend_atomic && !(bf->pathname = strdup(pathname))) {
+        report_error("Failed to allocate memory for pathname");
+        buffered_close(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+buffered_file_t *buffered_open_ex(const char *pathname, int flags, mode_t mode, const buffered_open_options_t *opts) {
+    return open_handle(NULL, pathname, flags, mode, opts);
+}
+
+buffered_file_t *buffered_open_from_pool(buffered_pool_t *pool, const char *pathname, int flags, mode_t mode) {
+    return open_handle(pool, pathname, flags, mode, &pool->opts);
+}
+
+// Read exactly count bytes at offset unless end of file comes first, returns the bytes read or -1
+static ssize_t pread_full(buffered_stats_t *stats, int fd, void *buf, size_t count, off_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t read_bytes = pread(fd, (char *) buf + total, count - total, offset + (off_t) total);
+        STAT_ADD(stats, read_syscalls, 1);
+        if (read_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (read_bytes == 0)
+            break;
+        total += (size_t) read_bytes;
+        STAT_ADD(stats, kernel_bytes_read, read_bytes);
+    }
+    return (ssize_t) total;
+}
+
+// Write all count bytes at offset, resuming after partial writes and interrupted calls
+static int pwrite_all(buffered_stats_t *stats, int fd, const void *buf, size_t count, off_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t written_bytes = pwrite(fd, (const char *) buf + total, count - total, offset + (off_t) total);
+        STAT_ADD(stats, write_syscalls, 1);
+        if (written_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += (size_t) written_bytes;
+        STAT_ADD(stats, kernel_bytes_written, written_bytes);
+    }
+    return 0;
+}
+
+// Process-wide block cache. Blocks of BUFFER_CACHE_BLOCK bytes are keyed by (device, inode, block number)
+// and spread over BUFFER_CACHE_SHARDS shards, each with its own lock, hash chains and CLOCK hand.
+// Every file also has a generation, taken from a direct-mapped table so no per-file state is allocated.
+// A block is only valid while the generation it was loaded under is current, so writes through any
+// handle drop every cached block of their file by bumping one counter. Files sharing a table slot
+// only invalidate each other more often than needed
+
+// Number of generation counters, files are mapped onto them by hashing device and inode
+#define CACHE_FILE_SLOTS 1024
+
+struct cache_block {
+    dev_t dev;                  // Key: the file's device
+    ino_t ino;                  // Key: the file's inode, 0 while the slot was never used
+    off_t index;                // Key: block number within the file
+    uint64_t generation;        // Generation of the file the data was loaded under
+    size_t length;              // Valid bytes, short only for the block holding the end of the file
+    int referenced;             // CLOCK bit, set by every hit and cleared as the hand sweeps past
+    char *data;                 // BUFFER_CACHE_BLOCK bytes, allocated when the slot is first filled
+    struct cache_block *next;   // Next block in the same hash chain
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_block *blocks; // Slots the CLOCK hand sweeps over
+    size_t capacity;            // Number of slots, the shard's part of the memory budget
+    size_t used;                // Slots filled so far, eviction only starts once all are
+    size_t hand;                // Next slot the CLOCK hand looks at
+    struct cache_block **buckets; // Hash chains, bucket_mask + 1 of them
+    size_t bucket_mask;
+};
+
+static struct cache_shard cache_shards[BUFFER_CACHE_SHARDS];
+static uint64_t cache_generations[CACHE_FILE_SLOTS];
+static int64_t cache_stamps[CACHE_FILE_SLOTS];  // Modification time of the file last opened in each slot
+static int cache_started;                       // Set once the shards exist, read without the lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t cache_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static uint64_t *cache_generation(dev_t dev, ino_t ino) {
+    return &cache_generations[cache_mix((uint64_t) dev * 31 + (uint64_t) ino) % CACHE_FILE_SLOTS];
+}
+
+static uint64_t cache_hash(dev_t dev, ino_t ino, off_t index) {
+    return cache_mix(cache_mix((uint64_t) dev * 31 + (uint64_t) ino) + (uint64_t) index);
+}
+
+// Create the shards for budget bytes, called with cache_lock held
+static int cache_start(size_t budget) {
+    size_t capacity = budget / BUFFER_CACHE_BLOCK / BUFFER_CACHE_SHARDS;
+    if (capacity == 0)
+        capacity = 1;
+    size_t buckets = 1;
+    while (buckets < capacity)
+        buckets *= 2;
+
+    for (int i = 0; i < BUFFER_CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache_shards[i];
+        shard->blocks = (struct cache_block *)calloc(capacity, sizeof(struct cache_block));
+        shard->buckets = (struct cache_block **)calloc(buckets, sizeof(struct cache_block *));
+        if (!shard->blocks || !shard->buckets) {
+            for (int j = 0; j <= i; j++) {
+                free(cache_shards[j].blocks);
+                free(cache_shards[j].buckets);
+            }
+            return -1;
+        }
+        shard->capacity = capacity;
+        shard->bucket_mask = buckets - 1;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    __atomic_store_n(&cache_started, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int buffered_cache_configure(size_t budget) {
+    pthread_mutex_lock(&cache_lock);
+    int result = -1;
+    if (cache_started) {
+        errno = EBUSY;
+    } else if (cache_start(budget ? budget : BUFFER_CACHE_BUDGET) == -1) {
+        errno = ENOMEM;
+    } else {
+        result = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Join the cache with a handle opened on the file st describes, starting the cache if nobody has.
+// A file whose modification time differs from the one last seen in its slot was changed behind the
+// library's back (or its inode was reused), so whatever is cached for it is dropped
+static int cache_open_file(const struct stat *st) {
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_started && cache_start(BUFFER_CACHE_BUDGET) == -1) {
+        pthread_mutex_unlock(&cache_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t slot = (size_t) (cache_generation(st->st_dev, st->st_ino) - cache_generations);
+    int64_t stamp = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    if (cache_stamps[slot] != stamp) {
+        cache_stamps[slot] = stamp;
+        __atomic_add_fetch(&cache_generations[slot], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// Remember which file the handle has open, so its writes can invalidate the file's cached blocks
+static void cache_identify(buffered_file_t *bf, const struct stat *st) {
+    bf->cache_dev = st->st_dev;
+    bf->cache_ino = st->st_ino;
+}
+
+// The handle has just changed its file, every cached block of it is stale now
+static void cache_written(buffered_file_t *bf) {
+    if (bf->cache_ino && __atomic_load_n(&cache_started, __ATOMIC_RELAXED))
+        __atomic_add_fetch(cache_generation(bf->cache_dev, bf->cache_ino), 1, __ATOMIC_RELEASE);
+}
+
+static struct cache_block *cache_find(struct cache_shard *shard, uint64_t hash, dev_t dev, ino_t ino, off_t index) {
+    struct cache_block *block = shard->buckets[(hash / BUFFER_CACHE_SHARDS) & shard->bucket_mask];
+    while (block && (block->index != index || block->ino != ino || block->dev != dev))
+        block = block->next;
+    return block;
+}
+
+// Store a freshly loaded block, taking *data and handing back the buffer it replaces (NULL if none)
+static void cache_insert(struct cache_shard *shard, uint64_t hash, dev_t dev, ino_t ino, off_t index,
+                         uint64_t generation, char **data, size_t length) {
+    struct cache_block *block = cache_find(shard, hash, dev, ino, index);
+    if (!block) {
+        if (shard->used < shard->capacity) {
+            block = &shard->blocks[shard->used++];
+        } else {
+            // CLOCK: blocks hit since the hand last passed get another round
+            while (shard->blocks[shard->hand].referenced) {
+                shard->blocks[shard->hand].referenced = 0;
+                shard->hand = (shard->hand + 1) % shard->capacity;
+            }
+            block = &shard->blocks[shard->hand];
+            shard->hand = (shard->hand + 1) % shard->capacity;
+
+            struct cache_block **link = &shard->buckets[(cache_hash(block->dev, block->ino, block->index) /
+                                                         BUFFER_CACHE_SHARDS) & shard->bucket_mask];
+            while (*link != block)
+                link = &(*link)->next;
+            *link = block->next;
+        }
+        block->dev = dev;
+        block->ino = ino;
+        block->index = index;
+        struct cache_block **bucket = &shard->buckets[(hash / BUFFER_CACHE_SHARDS) & shard->bucket_mask];
+        block->next = *bucket;
+        *bucket = block;
+    }
+
+    char *old = block->data;
+    block->data = *data;
+    *data = old;
+    block->generation = generation;
+    block->length = length;
+    block->referenced = 1;
+}
+
+// pread through the block cache: blocks of the current generation are copied out of it, missing ones
+// are read from the file whole and kept. Returns the bytes read, fewer than count only at end of file
+static ssize_t cache_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset) {
+    char *dest = buf;
+    char *spare = NULL;
+    size_t done = 0;
+    while (done < count) {
+        off_t position = offset + (off_t) done;
+        off_t index = position / BUFFER_CACHE_BLOCK;
+        size_t within = (size_t) (position % BUFFER_CACHE_BLOCK);
+        uint64_t hash = cache_hash(bf->cache_dev, bf->cache_ino, index);
+        struct cache_shard *shard = &cache_shards[hash % BUFFER_CACHE_SHARDS];
+        uint64_t *generation = cache_generation(bf->cache_dev, bf->cache_ino);
+        uint64_t current = __atomic_load_n(generation, __ATOMIC_ACQUIRE);
+
+        size_t block_length = 0, length = 0;
+        int hit = 0;
+        pthread_mutex_lock(&shard->lock);
+        struct cache_block *block = cache_find(shard, hash, bf->cache_dev, bf->cache_ino, index);
+        if (block && block->generation == current) {
+            block->referenced = 1;
+            block_length = block->length;
+            length = block_length > within ? min(block_length - within, count - done) : 0;
+            memcpy(dest + done, block->data + within, length);
+            hit = 1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        if (hit) {
+            STAT_ADD(bf->stats, cache_hits, 1);
+        } else {
+            if (!spare && !(spare = (char *)malloc(BUFFER_CACHE_BLOCK))) {
+                report_error("Failed to allocate cache block");
+                return done ? (ssize_t) done : -1;
+            }
+            ssize_t loaded = pread_full(bf->stats, bf->fd, spare, BUFFER_CACHE_BLOCK, index * BUFFER_CACHE_BLOCK);
+            if (loaded == -1) {
+                free(spare);
+                return done ? (ssize_t) done : -1;
+            }
+            STAT_ADD(bf->stats, cache_misses, 1);
+            block_length = (size_t) loaded;
+            length = block_length > within ? min(block_length - within, count - done) : 0;
+            memcpy(dest + done, spare + within, length);
+
+            // A write that finished while the block was read has made it stale before it got in
+            pthread_mutex_lock(&shard->lock);
+            if (__atomic_load_n(generation, __ATOMIC_ACQUIRE) == current)
+                cache_insert(shard, hash, bf->cache_dev, bf->cache_ino, index, current, &spare, block_length);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        done += length;
+
+        // A short block holds the end of the file
+        if (block_length < BUFFER_CACHE_BLOCK)
+            break;
+    }
+    free(spare);
+    return (ssize_t) done;
+}
+
+// Move every byte from offset to the end of the file up by shift bytes, working from the back so
+// nothing is overwritten before it has been read and no scratch file is needed
+static int shift_file_tail(buffered_stats_t *stats, int fd, off_t offset, off_t file_size, size_t shift) {
+    STAT_ADD(stats, prepend_bytes_moved, file_size - offset);
+    size_t chunk_size = min(BUFFER_SHIFT_CHUNK, (size_t) (file_size - offset));
+    char *chunk = (char *)malloc(chunk_size);
+    if (!chunk) {
+        report_error("Failed to allocate shift buffer");
+        return -1;
+    }
+
+    off_t end = file_size;
+    while (end > offset) {
+        size_t length = min(chunk_size, (size_t) (end - offset));
+        off_t start = end - (off_t) length;
+
+        ssize_t read_bytes = pread_full(stats, fd, chunk, length, start);
+        if (read_bytes != (ssize_t) length) {
+            if (read_bytes != -1)
+                errno = EIO;
+            report_error("Failed to read existing data from original file");
+            free(chunk);
+            return -1;
+        }
+        if (pwrite_all(stats, fd, chunk, length, start + (off_t) shift) == -1) {
+            report_error("Failed to move existing data in original file");
+            free(chunk);
+            return -1;
+        }
+        end = start;
+    }
+
+    free(chunk);
+    return 0;
+}
+
+// Insert count bytes at offset, pushing the rest of the file back. Block-aligned inserts are done
+// by the filesystem with FALLOC_FL_INSERT_RANGE, everything else falls back to shifting the tail
+static int insert_into_file(buffered_stats_t *stats, int fd, off_t offset, const void *buf, size_t count) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        report_error("Failed to stat file");
+        return -1;
+    }
+
+    if (offset < st.st_size) {
+        int inserted = 0;
+
+#ifdef FALLOC_FL_INSERT_RANGE
+        // The range can only be inserted in whole filesystem blocks, padding the data to a block
+        // boundary would change the file contents so unaligned inserts take the shifting path
+        size_t block = st.st_blksize > 0 ? (size_t) st.st_blksize : BUFFER_SIZE;
+        if ((size_t) offset % block == 0 && count % block == 0) {
+            if (fallocate(fd, FALLOC_FL_INSERT_RANGE, offset, (off_t) count) == 0)
+                inserted = 1;
+            else if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS) {
+                report_error("Failed to insert range into file");
+                return -1;
+            }
+        }
+#endif
+
+        if (!inserted && shift_file_tail(stats, fd, offset, st.st_size, count) == -1)
+            return -1;
+    }
+
+    if (pwrite_all(stats, fd, buf, count, offset) == -1) {
+        report_error("Failed to write buffer content to file");
+        return -1;
+    }
+    return 0;
+}
+
+// Copy count bytes between two files at the given offsets, letting the kernel (or the filesystem,
+// when it can share extents) move the data and falling back to pread/pwrite where it cannot
+static int copy_range(buffered_stats_t *stats, int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t count) {
+    while (count > 0) {
+        ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, count, 0);
+        STAT_ADD(stats, write_syscalls, 1);
+        if (copied > 0) {
+            STAT_ADD(stats, kernel_bytes_written, copied);
+            count -= (size_t) copied;
+            continue;
+        }
+        if (copied == 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+            return -1;
+
+        size_t chunk_size = min(BUFFER_SHIFT_CHUNK, count);
+        char *chunk = (char *)malloc(chunk_size);
+        if (!chunk)
+            return -1;
+        while (count > 0) {
+            ssize_t read_bytes = pread_full(stats, in_fd, chunk, min(chunk_size, count), in_offset);
+            if (read_bytes <= 0 || pwrite_all(stats, out_fd, chunk, (size_t) read_bytes, out_offset) == -1) {
+                free(chunk);
+                return read_bytes == 0 ? 0 : -1;
+            }
+            in_offset += read_bytes;
+            out_offset += read_bytes;
+            count -= (size_t) read_bytes;
+        }
+        free(chunk);
+    }
+    return 0;
+}
+
+// Give a scratch file a unique name in directory so it can be renamed over the target.
+// O_TMPFILE files are linked in through /proc, mkostemp files already have a name
+static int link_scratch_file(int fd, const char *directory, const char *base, char *name, size_t name_size) {
+    static unsigned long counter;
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        unsigned long id = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        snprintf(name, name_size, "%s/.%s.%ld.%lu", directory, base, (long) getpid(), id);
+        if (linkat(AT_FDCWD, proc_path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0)
+            return 0;
+        if (errno != EEXIST)
+            return -1;
+    }
+    return -1;
+}
+
+// Insert count bytes at offset by writing the whole new file into anonymous scratch space on the
+// same filesystem and atomically renaming it over the original. A crash leaves either the old
+// file or the new one, and concurrent writers never share a scratch file. On success bf->fd
+// refers to the new file
+static int atomic_insert_into_file(buffered_file_t *bf, off_t offset, const void *buf, size_t count) {
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1) {
+        report_error("Failed to stat file");
+        return -1;
+    }
+
+    // Split the path into the directory the scratch file must live in and the file's own name
+    char directory[4096];
+    const char *slash = strrchr(bf->pathname, '/');
+    const char *base = slash ? slash + 1 : bf->pathname;
+    if (!slash) {
+        strcpy(directory, ".");
+    } else if (slash == bf->pathname) {
+        strcpy(directory, "/");
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int) (slash - bf->pathname), bf->pathname);
+    }
+
+    char name[4096 + 64];
+    int named = 0;
+    int temp_fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, st.st_mode & 07777);
+    if (temp_fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        // Filesystems without O_TMPFILE get a uniquely named file instead
+        snprintf(name, sizeof(name), "%s/.%s.XXXXXX", directory, base);
+        temp_fd = mkostemp(name, O_CLOEXEC);
+        named = 1;
+    }
+    if (temp_fd == -1) {
+        report_error("Failed to open temporary file");
+        return -1;
+    }
+
+    off_t tail = offset < st.st_size ? st.st_size - offset : 0;
+    off_t head = offset < st.st_size ? offset : st.st_size;
+    STAT_ADD(bf->stats, prepend_bytes_moved, head + tail);
+    if (copy_range(bf->stats, bf->fd, 0, temp_fd, 0, (size_t) head) == -1 ||
+        pwrite_all(bf->stats, temp_fd, buf, count, offset) == -1 ||
+        copy_range(bf->stats, bf->fd, offset, temp_fd, offset + (off_t) count, (size_t) tail) == -1) {
+        report_error("Failed to write temporary file");
+        goto fail;
+    }
+
+    // The data has to be on disk before the name points at it
+    if (fchmod(temp_fd, st.st_mode & 07777) == -1 || fsync(temp_fd) == -1) {
+        report_error("Failed to sync temporary file");
+        goto fail;
+    }
+
+    if (!named) {
+        if (link_scratch_file(temp_fd, directory, base, name, sizeof(name)) == -1) {
+            report_error("Failed to link temporary file");
+            goto fail;
+        }
+        named = 1;
+    }
+    if (renameat(AT_FDCWD, name, AT_FDCWD, bf->pathname) == -1) {
+        report_error("Failed to replace original file");
+        goto fail;
+    }
+
+    // Make the rename itself durable
+    int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    // Carry the status flags over, the scratch file was opened read-write without them
+    fcntl(temp_fd, F_SETFL, bf->flags & (O_APPEND | O_NONBLOCK | O_NOATIME));
+    close(bf->fd);
+    bf->fd = temp_fd;
+
+    // The handle now writes to the new inode, whose number may have been used by a file still cached
+    if (fstat(temp_fd, &st) == 0) {
+        cache_identify(bf, &st);
+        cache_written(bf);
+    }
+    return 0;
+
+fail:
+    if (named)
+        unlink(name);
+    close(temp_fd);
+    return -1;
+}
+
+// Queue data for O_PREAPPEND, it reaches the file in a single insert on the next flush
+static ssize_t pre_append_write(buffered_file_t *bf, const void *buf, size_t count) {
+    size_t needed = bf->prepend_buffer_pos + count;
+    if (needed > bf->prepend_buffer_size) {
+        size_t new_size = bf->prepend_buffer_size ? bf->prepend_buffer_size : BUFFER_SIZE;
+        while (new_size < needed)
+            new_size *= 2;
+
+        char *new_buffer = (char *)realloc(bf->prepend_buffer, new_size);
+        if (!new_buffer) {
+            report_error("Failed to grow prepend buffer");
+            return -1;
+        }
+        bf->prepend_buffer = new_buffer;
+        bf->prepend_buffer_size = new_size;
+    }
+
+    memcpy(bf->prepend_buffer + bf->prepend_buffer_pos, buf, count);
+    bf->prepend_buffer_pos += count;
+
+    // Bound the memory held by a long prepend session, each insert costs one pass over the file
+    if (bf->prepend_buffer_pos >= BUFFER_PREPEND_MAX && flush_handle(bf) == -1)
+        return -1;
+    return (ssize_t) count;
+}
+
+int flush_pre_append(buffered_file_t *bf) {
+    if (bf->prepend_buffer_pos == 0)
+        return 0;
+    if (bf->prefix_log)
+        return prefix_log_append(bf);
+
+    // Pending data goes in at the current position, earlier flushes have already moved it past their data
+    off_t current_pos = current_file_offset(bf);
+    if (current_pos == -1) {
+        report_error("Failed to get file position");
+        return -1;
+    }
+
+    uint64_t started = stats_clock(bf->stats);
+    if (bf->prepend_atomic) {
+        if (atomic_insert_into_file(bf, current_pos, bf->prepend_buffer, bf->prepend_buffer_pos) == -1)
+            return -1;
+    } else if (insert_into_file(bf->stats, bf->fd, current_pos, bf->prepend_buffer, bf->prepend_buffer_pos) == -1 ||
+               durability_written(bf, -1, bf->prepend_buffer_pos) == -1) {
+        // Atomic prepends are synced before the rename already, in-place ones follow the policy
+        return -1;
+    }
+
+    // Get to the position right after the inserted data
+    STAT_ADD(bf->stats, seek_syscalls, 1);
+    bf->file_offset = lseek(bf->fd, current_pos + (off_t) bf->prepend_buffer_pos, SEEK_SET);
+    bf->prepend_buffer_pos = 0;
+    stats_flush(bf->stats, started);
+    return 0;
+}
+
+
+// Write every byte described by iov, resuming after partial writes and interrupted calls
+static ssize_t writev_all(buffered_stats_t *stats, int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t written_bytes = writev(fd, iov, iovcnt);
+        STAT_ADD(stats, write_syscalls, 1);
+        if (written_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += written_bytes;
+        STAT_ADD(stats, kernel_bytes_written, written_bytes);
+
+        // Skip the vectors that went out completely and trim the one that went out partially
+        size_t done = (size_t) written_bytes;
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return total;
+}
+
+static int write_all(buffered_stats_t *stats, int fd, const void *buf, size_t count) {
+    struct iovec iov = { (void *) buf, count };
+    return writev_all(stats, fd, &iov, 1) == -1 ? -1 : 0;
+}
+
+// Sidecar prefix log for the prepend_log option. Prepending appends a record to <path>.prefix instead of
+// moving the file's data, so it costs the bytes prepended whatever the size of the file. The logical file
+// is the log's data, newest generation first, followed by the file itself. The header names the file by
+// device and inode, so a log left behind by a file that has since been replaced is ignored
+#define PREFIX_LOG_MAGIC "FOPREFX1"
+
+struct prefix_log_header {
+    char magic[8];              // PREFIX_LOG_MAGIC
+    uint64_t dev;               // Device of the file the log belongs to
+    uint64_t ino;               // Inode of the file the log belongs to
+};
+
+struct prefix_log_record {
+    uint64_t generation;        // Handle that wrote the record, each prepend_log handle starts a new generation
+    uint64_t length;            // Bytes of prepended data following the record
+};
+
+// Where a record's data sits in the log, for putting the records in logical order
+struct prefix_log_entry {
+    uint64_t generation;
+    size_t offset;
+    size_t length;
+};
+
+// Newer generations were prepended later and come first, one generation's records keep their order
+static int prefix_log_compare(const void *a, const void *b) {
+    const struct prefix_log_entry *x = a, *y = b;
+    if (x->generation != y->generation)
+        return x->generation > y->generation ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Load the prefix log of the file open on fd. *generation gets the newest generation in it and *valid
+// the length of the log up to its last whole record, both 0 when the file has no log of its own. With
+// prefix set the logical prefix is assembled into *prefix (NULL when empty) and *prefix_length
+static int prefix_log_load(const char *pathname, int fd, char **prefix, size_t *prefix_length, uint64_t *generation,
+                           size_t *valid) {
+    *prefix_length = 0;
+    *generation = 0;
+    *valid = 0;
+    if (prefix)
+        *prefix = NULL;
+
+    char path[PATH_MAX + sizeof(BUFFER_PREFIX_SUFFIX)];
+    if (snprintf(path, sizeof(path), "%s%s", pathname, BUFFER_PREFIX_SUFFIX) >= (int) sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int log_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (log_fd == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    struct stat st, log_st;
+    char *log = NULL;
+    struct prefix_log_entry *entries = NULL;
+    int result = -1;
+    if (fstat(fd, &st) == -1 || fstat(log_fd, &log_st) == -1)
+        goto out;
+    result = 0;
+    struct prefix_log_header header;
+    if ((size_t) log_st.st_size < sizeof(header))
+        goto out;
+
+    // Logs stay small, they are read whole
+    size_t length = (size_t) log_st.st_size;
+    ssize_t read_bytes;
+    if (!(log = (char *)malloc(length)) || (read_bytes = pread_full(NULL, log_fd, log, length, 0)) == -1) {
+        result = -1;
+        goto out;
+    }
+    length = (size_t) read_bytes;
+    memcpy(&header, log, sizeof(header));
+    if (length < sizeof(header) || memcmp(header.magic, PREFIX_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.dev != (uint64_t) st.st_dev || header.ino != (uint64_t) st.st_ino)
+        goto out;
+
+    // Count the whole records, one torn by a crash at the end is left out
+    size_t pos = sizeof(header), count = 0, total = 0;
+    struct prefix_log_record record;
+    while (length - pos >= sizeof(record)) {
+        memcpy(&record, log + pos, sizeof(record));
+        if (record.length > length - pos - sizeof(record))
+            break;
+        if (record.generation > *generation)
+            *generation = record.generation;
+        total += (size_t) record.length;
+        pos += sizeof(record) + (size_t) record.length;
+        count++;
+    }
+    *valid = pos;
+    if (!prefix || total == 0)
+        goto out;
+
+    if (!(entries = (struct prefix_log_entry *)malloc(count * sizeof(*entries))) || !(*prefix = (char *)malloc(total))) {
+        result = -1;
+        goto out;
+    }
+    pos = sizeof(header);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&record, log + pos, sizeof(record));
+        entries[i].generation = record.generation;
+        entries[i].offset = pos + sizeof(record);
+        entries[i].length = (size_t) record.length;
+        pos += sizeof(record) + (size_t) record.length;
+    }
+    qsort(entries, count, sizeof(*entries), prefix_log_compare);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(*prefix + *prefix_length, log + entries[i].offset, entries[i].length);
+        *prefix_length += entries[i].length;
+    }
+
+out:
+    if (result == -1 && prefix) {
+        free(*prefix);
+        *prefix = NULL;
+        *prefix_length = 0;
+    }
+    free(entries);
+    free(log);
+    close(log_fd);
+    return result;
+}
+
+// Open the prefix log of bf's file for appending as a new generation, and cut off a record torn by a
+// crash so it cannot swallow the next one. Without a log of the file's own a new one is created. An
+// existing <path>.prefix that is not the file's log (valid is 0) is never overwritten, only an empty
+// one left by a crash before its header was written is taken over
+static int prefix_log_attach(buffered_file_t *bf, const char *pathname, uint64_t generation, size_t valid) {
+    char path[PATH_MAX + sizeof(BUFFER_PREFIX_SUFFIX)];
+    snprintf(path, sizeof(path), "%s%s", pathname, BUFFER_PREFIX_SUFFIX);
+
+    struct stat st, log_st;
+    if (fstat(bf->fd, &st) == -1) {
+        report_error("Failed to stat file");
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC | (valid == 0 ? O_CREAT | O_EXCL : 0), st.st_mode & 0666);
+    if (fd == -1 && errno == EEXIST) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &log_st) == -1 || log_st.st_size != 0)) {
+            close(fd);
+            fd = -1;
+            errno = EEXIST;
+        }
+    }
+    if (fd == -1) {
+        report_error("Failed to open prefix log");
+        return -1;
+    }
+
+    int failed;
+    if (valid == 0) {
+        struct prefix_log_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PREFIX_LOG_MAGIC, sizeof(header.magic));
+        header.dev = (uint64_t) st.st_dev;
+        header.ino = (uint64_t) st.st_ino;
+        failed = write_all(bf->stats, fd, &header, sizeof(header)) == -1;
+    } else {
+        failed = ftruncate(fd, (off_t) valid) == -1;
+    }
+    if (failed) {
+        report_error("Failed to prepare prefix log");
+        close(fd);
+        return -1;
+    }
+
+    // The handle is write-only and only ever appends to the log, reading goes to a read-only handle
+    bf->prefix_log = 1;
+    bf->prefix_fd = fd;
+    bf->prefix_generation = generation + 1;
+    bf->prepend_atomic = 0;
+    return 0;
+}
+
+// Remove the prefix log of pathname, which the caller has checked belongs to the file
+static int prefix_log_remove(const char *pathname) {
+    char path[PATH_MAX + sizeof(BUFFER_PREFIX_SUFFIX)];
+    snprintf(path, sizeof(path), "%s%s", pathname, BUFFER_PREFIX_SUFFIX);
+    return unlink(path) == -1 && errno != ENOENT ? -1 : 0;
+}
+
+// flush_pre_append in prefix log mode, the queued data goes out as one record and the file is untouched
+static int prefix_log_append(buffered_file_t *bf) {
+    struct prefix_log_record record = { bf->prefix_generation, bf->prepend_buffer_pos };
+    struct iovec iov[2] = { { &record, sizeof(record) }, { bf->prepend_buffer, bf->prepend_buffer_pos } };
+
+    uint64_t started = stats_clock(bf->stats);
+    if (writev_all(bf->stats, bf->prefix_fd, iov, 2) == -1) {
+        report_error("Failed to write prefix log");
+        return -1;
+    }
+    size_t length = bf->prepend_buffer_pos;
+    bf->prepend_buffer_pos = 0;
+    stats_flush(bf->stats, started);
+    return durability_written(bf, -1, length);
+}
+
+int buffered_compact(const char *pathname) {
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        report_error("Failed to open file");
+        return -1;
+    }
+
+    char *prefix;
+    size_t prefix_length, valid;
+    uint64_t generation;
+    if (prefix_log_load(pathname, fd, &prefix, &prefix_length, &generation, &valid) == -1) {
+        report_error("Failed to read prefix log");
+        close(fd);
+        return -1;
+    }
+
+    // The merged file gets a new inode, so the log stops matching it even if the unlink never happens
+    buffered_file_t merge;
+    memset(&merge, 0, sizeof(merge));
+    merge.fd = fd;
+    merge.pathname = (char *) pathname;
+    int result = prefix_length ? atomic_insert_into_file(&merge, 0, prefix, prefix_length) : 0;
+    free(prefix);
+    close(merge.fd);
+    if (result == -1)
+        return -1;
+
+    // A <path>.prefix that is not the file's log is left alone
+    if (valid != 0 && prefix_log_remove(pathname) == -1) {
+        report_error("Failed to remove prefix log");
+        return -1;
+    }
+    return 0;
+}
+
+// Background flusher for write-behind mode. The caller fills bf->write_buffer, which is always the
+// ring slot at head + queued, and full slots are written out in order by the flusher thread
+struct buffered_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signalled when a buffer is queued or written, and on shutdown
+    int fd;
+    buffered_stats_t *stats;    // The handle's statistics, the flusher counts its writes there
+    buffered_file_t *owner;     // Handle whose stateless durability_started the flusher applies after each write
+    size_t written;             // Bytes written since the owner last took them into its durability account
+    char **buffers;             // Ring of write buffers, all write_buffer_size bytes long
+    size_t *lengths;            // Number of bytes to write from each queued buffer
+    int count;                  // Number of buffers in the ring
+    int head;                   // Oldest queued buffer, the one the flusher writes next
+    int queued;                 // Number of buffers queued or being written
+    int error;                  // errno of the first failed background write, reported on the next flush
+    int stop;                   // Set by buffered_close once everything is queued
+};
+
+static void *writer_main(void *arg) {
+    struct buffered_writer *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->stop)
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        if (writer->queued == 0)
+            break;
+
+        char *buffer = writer->buffers[writer->head];
+        size_t length = writer->lengths[writer->head];
+        int failed = writer->error != 0;
+        pthread_mutex_unlock(&writer->lock);
+
+        // Once a write has failed the rest are dropped rather than leaving a hole in the file
+        int error = 0;
+        uint64_t started = stats_clock(writer->stats);
+        if (!failed && write_all(writer->stats, writer->fd, buffer, length) == -1)
+            error = errno;
+        else if (!failed)
+            durability_started(writer->owner, -1, length);
+        stats_flush(writer->stats, started);
+
+        pthread_mutex_lock(&writer->lock);
+        if (error && !writer->error)
+            writer->error = error;
+        else if (!failed && !error)
+            writer->written += length;
+        writer->head = (writer->head + 1) % writer->count;
+        writer->queued--;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Switch bf to write-behind with count buffers, the existing write buffer becomes the first one.
+// If the flusher cannot be started the handle simply stays synchronous
+static void writer_start(buffered_file_t *bf, int count) {
+    struct buffered_writer *writer = (struct buffered_writer *)calloc(1, sizeof(*writer));
+    if (!writer)
+        return;
+    writer->buffers = (char **)calloc((size_t) count, sizeof(char *));
+    writer->lengths = (size_t *)calloc((size_t) count, sizeof(size_t));
+    if (!writer->buffers || !writer->lengths)
+        goto fail;
+
+    writer->buffers[0] = bf->write_buffer;
+    for (int i = 1; i < count; i++) {
+        if (!(writer->buffers[i] = (char *)malloc(bf->write_buffer_size)))
+            goto fail;
+    }
+    writer->fd = bf->fd;
+    writer->stats = bf->stats;
+    writer->owner = bf;
+    writer->count = count;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->cond);
+        goto fail;
+    }
+    bf->writer = writer;
+    return;
+
+fail:
+    if (writer->buffers) {
+        for (int i = 1; i < count; i++)
+            free(writer->buffers[i]);
+    }
+    free(writer->buffers);
+    free(writer->lengths);
+    free(writer);
+}
+
+// Take the bytes the flusher wrote since the last call, with the writer lock held. The owner feeds them
+// to its durability account, which the flusher never touches
+static size_t writer_collect(struct buffered_writer *writer) {
+    size_t written = writer->written;
+    writer->written = 0;
+    return written;
+}
+
+// Whether written data is still with the flusher, or written but not yet collected by the owner
+static int writer_busy(buffered_file_t *bf) {
+    struct buffered_writer *writer = bf->writer;
+    if (!writer)
+        return 0;
+    pthread_mutex_lock(&writer->lock);
+    int busy = writer->queued != 0 || writer->written != 0;
+    pthread_mutex_unlock(&writer->lock);
+    return busy;
+}
+
+// Queue the current write buffer for the flusher and continue in the next free one
+static int writer_submit(buffered_file_t *bf) {
+    struct buffered_writer *writer = bf->writer;
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->error) {
+        errno = writer->error;
+        writer->error = 0;
+        pthread_mutex_unlock(&writer->lock);
+        report_error("Failed to write to file");
+        return -1;
+    }
+
+    int slot = (writer->head + writer->queued) % writer->count;
+    writer->lengths[slot] = bf->write_buffer_pos;
+    writer->queued++;
+    pthread_cond_broadcast(&writer->cond);
+
+    // Every buffer is in flight, wait for the oldest one to come back
+    while (writer->queued == writer->count)
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    size_t written = writer_collect(writer);
+    pthread_mutex_unlock(&writer->lock);
+
+    bf->write_buffer = writer->buffers[(slot + 1) % writer->count];
+    bf->write_buffer_pos = 0;
+    return durability_account(bf, written);
+}
+
+// Wait until every queued buffer has been written and report the first error among them
+static int writer_wait(buffered_file_t *bf) {
+    struct buffered_writer *writer = bf->writer;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued > 0)
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    int error = writer->error;
+    writer->error = 0;
+    size_t written = writer_collect(writer);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (error) {
+        errno = error;
+        report_error("Failed to write to file");
+        return -1;
+    }
+    return durability_account(bf, written);
+}
+
+// Stop the flusher thread and release the ring
+static void writer_stop(buffered_file_t *bf) {
+    struct buffered_writer *writer = bf->writer;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    // The first buffer is the one that came with the handle
+    for (int i = 1; i < writer->count; i++)
+        free(writer->buffers[i]);
+    bf->write_buffer = writer->buffers[0];
+    free(writer->buffers);
+    free(writer->lengths);
+    free(writer);
+    bf->writer = NULL;
+}
+
+// pread for O_DIRECT, which only accepts whole blocks, so a short read is the end of the file
+static ssize_t pread_blocks(buffered_stats_t *stats, int fd, void *buf, size_t count, off_t offset, size_t align) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t read_bytes = pread(fd, (char *) buf + total, count - total, offset + (off_t) total);
+        STAT_ADD(stats, read_syscalls, 1);
+        if (read_bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += (size_t) read_bytes;
+        STAT_ADD(stats, kernel_bytes_read, read_bytes);
+        if (read_bytes == 0 || (size_t) read_bytes % align != 0)
+            break;
+    }
+    return (ssize_t) total;
+}
+
+// Fill the read window in O_DIRECT mode. The window starts on the block boundary at or before the
+// caller's position and is read in whole blocks straight into the aligned buffer, so want bytes past
+// the position are available afterwards unless the file ends first
+static int direct_fill(buffered_file_t *bf, size_t want) {
+    size_t align = bf->direct_align;
+    off_t position = bf->file_offset - (off_t) (bf->read_buffer_size - bf->read_buffer_pos);
+    off_t start = position - position % (off_t) align;
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+
+    // Whole blocks already buffered from start on are moved to the front and kept
+    size_t kept = 0;
+    if (bf->read_buffer_size != 0 && start >= window_start && start < bf->file_offset) {
+        kept = (size_t) (bf->file_offset - start);
+        memmove(bf->read_buffer, bf->read_buffer + (start - window_start), kept);
+        kept -= kept % align;
+    }
+
+    size_t target = min((size_t) (position - start) + want, bf->read_buffer_capacity);
+    size_t filled = kept;
+    if (filled < target) {
+        ssize_t read_bytes = pread_blocks(bf->stats, bf->fd, bf->read_buffer + filled, bf->read_buffer_capacity - filled,
+                                          start + (off_t) filled, align);
+        if (read_bytes == -1)
+            return -1;
+        filled += (size_t) read_bytes;
+    }
+
+    // Past the end of the file the window is left empty at the caller's position
+    if (filled <= (size_t) (position - start)) {
+        bf->read_buffer_size = 0;
+        bf->read_buffer_pos = 0;
+        bf->file_offset = position;
+        return 0;
+    }
+    bf->read_buffer_size = filled;
+    bf->read_buffer_pos = (size_t) (position - start);
+    bf->file_offset = start + (off_t) filled;
+    return 0;
+}
+
+// buffered_read for O_DIRECT mode, everything is staged through the aligned read buffer
+static ssize_t direct_read(buffered_file_t *bf, char *dest, size_t count) {
+    size_t bytes_read = 0;
+    while (bytes_read < count) {
+        if (bf->read_buffer_pos == bf->read_buffer_size) {
+            if (direct_fill(bf, count - bytes_read) == -1) {
+                report_error("Failed to read from file");
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            }
+
+            // No more to read from the file
+            if (bf->read_buffer_pos == bf->read_buffer_size)
+                break;
+        }
+
+        size_t length = min(bf->read_buffer_size - bf->read_buffer_pos, count - bytes_read);
+        memcpy(dest + bytes_read, bf->read_buffer + bf->read_buffer_pos, length);
+        bf->read_buffer_pos += length;
+        bytes_read += length;
+    }
+    return (ssize_t) bytes_read;
+}
+
+// pread at any offset and length in O_DIRECT mode, through an aligned bounce buffer
+static ssize_t direct_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset) {
+    size_t align = bf->direct_align;
+    off_t start = offset - offset % (off_t) align;
+    size_t length = round_up((size_t) (offset - start) + count, align);
+
+    void *bounce;
+    if (posix_memalign(&bounce, align, length) != 0)
+        return -1;
+
+    ssize_t read_bytes = pread_blocks(bf->stats, bf->fd, bounce, length, start, align);
+    if (read_bytes != -1) {
+        size_t skip = (size_t) (offset - start);
+        read_bytes = (size_t) read_bytes > skip ? (ssize_t) min((size_t) read_bytes - skip, count) : 0;
+        memcpy(buf, (char *) bounce + skip, (size_t) read_bytes);
+    }
+    free(bounce);
+    return read_bytes;
+}
+
+// pwrite at any offset and length in O_DIRECT mode. The partial blocks at either end are read back
+// first so their other bytes survive, and padding written past the end of the file is cut off again
+static int direct_pwrite(buffered_file_t *bf, const void *buf, size_t count, off_t offset) {
+    size_t align = bf->direct_align;
+    off_t start = offset - offset % (off_t) align;
+    size_t length = round_up((size_t) (offset - start) + count, align);
+
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1)
+        return -1;
+
+    void *bounce;
+    if (posix_memalign(&bounce, align, length) != 0)
+        return -1;
+    memset(bounce, 0, length);
+
+    int result = -1;
+    off_t last = start + (off_t) length - (off_t) align;
+    if (offset != start && pread_blocks(bf->stats, bf->fd, bounce, align, start, align) == -1)
+        goto out;
+    if ((offset + (off_t) count) % (off_t) align != 0 && (last != start || offset == start) &&
+        pread_blocks(bf->stats, bf->fd, (char *) bounce + (last - start), align, last, align) == -1)
+        goto out;
+
+    memcpy((char *) bounce + (offset - start), buf, count);
+    if (pwrite_all(bf->stats, bf->fd, bounce, length, start) == -1)
+        goto out;
+
+    off_t end = offset + (off_t) count > st.st_size ? offset + (off_t) count : st.st_size;
+    if (start + (off_t) length > end && ftruncate(bf->fd, end) == -1)
+        goto out;
+    result = 0;
+
+out:
+    free(bounce);
+    return result;
+}
+
+// Start a write buffer at an unaligned position in O_DIRECT mode by loading the head of its block,
+// so the buffer always covers whole blocks from a boundary
+static int direct_start_block(buffered_file_t *bf) {
+    size_t align = bf->direct_align;
+    size_t head = (size_t) (bf->file_offset % (off_t) align);
+    if (head == 0)
+        return 0;
+
+    off_t start = bf->file_offset - (off_t) head;
+    ssize_t read_bytes = pread_blocks(bf->stats, bf->fd, bf->write_buffer, align, start, align);
+    if (read_bytes == -1) {
+        report_error("Failed to read from file");
+        return -1;
+    }
+    if ((size_t) read_bytes < head)
+        memset(bf->write_buffer + read_bytes, 0, head - (size_t) read_bytes);
+
+    bf->write_buffer_pos = head;
+    bf->file_offset = start;
+    return 0;
+}
+
+// Write the whole blocks at the front of the write buffer in O_DIRECT mode, the partial last block
+// stays behind at the front of the buffer
+static int direct_flush_blocks(buffered_file_t *bf) {
+    size_t length = bf->write_buffer_pos - bf->write_buffer_pos % bf->direct_align;
+    if (length == 0)
+        return 0;
+
+    if (pwrite_all(bf->stats, bf->fd, bf->write_buffer, length, bf->file_offset) == -1) {
+        report_error("Failed to write to file");
+        return -1;
+    }
+    if (durability_written(bf, bf->file_offset, length) == -1)
+        return -1;
+    memmove(bf->write_buffer, bf->write_buffer + length, bf->write_buffer_pos - length);
+    bf->write_buffer_pos -= length;
+    bf->file_offset += (off_t) length;
+    return 0;
+}
+
+// Move the tracked fd offset past count bytes just written. O_APPEND writes land at the end of the
+// file wherever the offset was, so there it becomes unknown until current_file_offset asks the kernel
+static void advance_file_offset(buffered_file_t *bf, size_t count) {
+    if (bf->flags & O_APPEND)
+        bf->file_offset = -1;
+    else if (bf->file_offset != -1)
+        bf->file_offset += (off_t) count;
+}
+
+// Whether written data is still held by the handle instead of the file
+static int writes_pending(buffered_file_t *bf) {
+    return bf->write_buffer_pos != 0 || bf->prepend_buffer_pos != 0 || bf->dirty_end != bf->dirty_start ||
+           (bf->writer && __atomic_load_n(&bf->writer->queued, __ATOMIC_ACQUIRE) != 0);
+}
+
+// Drop the read window before writing. Read-ahead has moved the fd past the caller's position, so
+// on regular files the fd is moved back to where the caller actually is
+static int drop_read_buffer(buffered_file_t *bf) {
+    size_t unread = bf->read_buffer_size - bf->read_buffer_pos;
+    if (bf->direct_align) {
+        // Direct I/O is positional, only the tracked offset moves
+        bf->file_offset -= (off_t) unread;
+    } else if (unread != 0 && bf->read_regular == 1) {
+        STAT_ADD(bf->stats, seek_syscalls, 1);
+        off_t offset = lseek(bf->fd, -(off_t) unread, SEEK_CUR);
+        if (offset == -1) {
+            report_error("Failed to seek file");
+            return -1;
+        }
+        bf->file_offset = offset;
+    }
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    return 0;
+}
+
+// Hand the write buffer to the kernel, or to the background flusher in write-behind mode
+static int flush_write_buffer(buffered_file_t *bf) {
+    if (bf->write_buffer_pos == 0)
+        return 0;
+    uint64_t started = stats_clock(bf->stats);
+    if (bf->direct_align) {
+        if (direct_flush_blocks(bf) == -1)
+            return -1;
+        stats_flush(bf->stats, started);
+        return 0;
+    }
+    // The tracked offset moves only once the data is accepted, a failed flush keeps it in the buffer
+    // for the next attempt
+    off_t offset = write_buffer_offset(bf);
+    size_t written = bf->write_buffer_pos;
+    if (bf->writer) {
+        int result = writer_submit(bf);
+        if (result != -1 || bf->write_buffer_pos == 0)
+            advance_file_offset(bf, written);
+        return result;
+    }
+
+    if (write_all(bf->stats, bf->fd, bf->write_buffer, bf->write_buffer_pos) == -1) {
+        report_error("Failed to write to file");
+        return -1;
+    }
+    advance_file_offset(bf, written);
+    bf->write_buffer_pos = 0; // Reset the buffer position
+    stats_flush(bf->stats, started);
+    return durability_written(bf, offset, written);
+}
+
+// Shared window of a coherent handle. The window covers [file_offset - read_buffer_size, file_offset)
+// and is read and written with pread/pwrite at tracked offsets, so the fd offset plays no part.
+// Written bytes stay in the window until it has to move or the caller flushes
+
+// Write the dirty part of the window back to the file
+static int coherent_flush(buffered_file_t *bf) {
+    if (bf->dirty_end == bf->dirty_start)
+        return 0;
+
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+    uint64_t started = stats_clock(bf->stats);
+    off_t offset = window_start + (off_t) bf->dirty_start;
+    size_t length = bf->dirty_end - bf->dirty_start;
+    if (pwrite_all(bf->stats, bf->fd, bf->read_buffer + bf->dirty_start, length, offset) == -1) {
+        report_error("Failed to write to file");
+        return -1;
+    }
+    bf->dirty_start = 0;
+    bf->dirty_end = 0;
+    stats_flush(bf->stats, started);
+    return durability_written(bf, offset, length);
+}
+
+// Empty the window and restart it at the caller's position
+static int coherent_move_window(buffered_file_t *bf, off_t position) {
+    if (coherent_flush(bf) == -1)
+        return -1;
+    bf->file_offset = position;
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    return 0;
+}
+
+// Mark count bytes placed in the window at start as written, growing the window when they run past its end
+static void coherent_mark(buffered_file_t *bf, size_t start, size_t count) {
+    if (bf->dirty_end == bf->dirty_start) {
+        bf->dirty_start = start;
+        bf->dirty_end = start + count;
+    } else {
+        bf->dirty_start = start < bf->dirty_start ? start : bf->dirty_start;
+        bf->dirty_end = start + count > bf->dirty_end ? start + count : bf->dirty_end;
+    }
+    if (start + count > bf->read_buffer_size) {
+        bf->file_offset += (off_t) (start + count - bf->read_buffer_size);
+        bf->read_buffer_size = start + count;
+    }
+}
+
+// Copy count bytes into the window at start
+static void coherent_store(buffered_file_t *bf, size_t start, const void *data, size_t count) {
+    memcpy(bf->read_buffer + start, data, count);
+    coherent_mark(bf, start, count);
+}
+
+static ssize_t coherent_write(buffered_file_t *bf, const char *data, size_t count) {
+    size_t written = 0;
+    while (written < count) {
+        size_t rest = count - written;
+        off_t position = bf->file_offset - (off_t) (bf->read_buffer_size - bf->read_buffer_pos);
+
+        // Writes at least as large as the window go straight to the file from a fresh window
+        if (rest >= bf->read_buffer_capacity) {
+            if (coherent_move_window(bf, position) == -1)
+                return written ? (ssize_t) written : -1;
+            if (pwrite_all(bf->stats, bf->fd, data + written, rest, position) == -1) {
+                report_error("Failed to write to file");
+                return written ? (ssize_t) written : -1;
+            }
+            bf->file_offset = position + (off_t) rest;
+            durability_deferred(bf, position, rest);
+            break;
+        }
+
+        // A full window is written back and started again where the caller is
+        if (bf->read_buffer_pos == bf->read_buffer_capacity && coherent_move_window(bf, position) == -1)
+            return written ? (ssize_t) written : -1;
+
+        size_t length = min(rest, bf->read_buffer_capacity - bf->read_buffer_pos);
+        coherent_store(bf, bf->read_buffer_pos, data + written, length);
+        bf->read_buffer_pos += length;
+        written += length;
+    }
+    return (ssize_t) count;
+}
+
+// Time-bounded flushing for handles opened with flush_latency_us, and group commit syncs for handles
+// with a sync interval. Such a handle gets a mutex that its public calls hold, and a deadline armed when
+// its buffers go from empty to holding written data, or when written data waits for the end of the group
+// commit period. One shared timer thread sleeps on a CLOCK_MONOTONIC condition variable until the
+// earliest deadline and flushes or syncs the handles that are due, so data left behind by the last call
+// is not kept waiting for the next one. Locks are taken handle first, registry second. The timer looks for
+// due handles with the registry lock held, so it only tries their locks, and a handle busy in a call
+// catches up on the way out when its deadline has passed by then
+struct buffered_autoflush {
+    pthread_mutex_t lock;       // Held by the handle's public calls, and by the timer while it flushes
+    buffered_file_t *owner;     // Handle the timer flushes
+    uint64_t latency;           // flush_latency_us in nanoseconds, 0 when only group commit syncs are timed
+    uint64_t flush_due;         // Monotonic time the oldest buffered byte is due, 0 while nothing is buffered
+    uint64_t deadline;          // Earlier of flush_due and the group commit sync, 0 for neither. Changed with both locks held
+    struct buffered_autoflush *next; // Next handle in the registry
+};
+
+static pthread_mutex_t autoflush_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the registry and the deadlines
+static pthread_cond_t autoflush_wake;   // Signalled for deadlines earlier than the timer's wakeup, and when the registry empties
+static pthread_once_t autoflush_once = PTHREAD_ONCE_INIT;
+static struct buffered_autoflush *autoflush_handles; // Handles with a latency bound
+static uint64_t autoflush_next;         // Time the timer wakes up next, UINT64_MAX while no deadline is armed
+static int autoflush_running;           // Set while the timer thread exists, it exits once the registry is empty
+
+static void autoflush_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&autoflush_wake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Whether written data waits in the handle. Buffers queued for write-behind are on their way already
+static int autoflush_pending(buffered_file_t *bf) {
+    return bf->write_buffer_pos != 0 || bf->prepend_buffer_pos != 0 || bf->dirty_end != bf->dirty_start;
+}
+
+// Monotonic time the group commit period ends while written data waits for its sync, 0 when no sync is
+// owed. Data still with the write-behind flusher counts, it reaches sync_pending once collected
+static uint64_t autoflush_sync_due(buffered_file_t *bf) {
+    if (bf->durability != BUFFER_DURABILITY_GROUP || !bf->sync_interval)
+        return 0;
+    if (bf->sync_pending == 0 && !writer_busy(bf))
+        return 0;
+    return bf->sync_last + bf->sync_interval;
+}
+
+// Act on whatever of a handle's deadline is due, with the handle's lock held: hand its buffered data to
+// the kernel, or to its background flusher, and end an expired group commit period with a sync
+static void autoflush_flush(buffered_file_t *bf) {
+    struct buffered_autoflush *af = bf->autoflush;
+    uint64_t now = monotonic_ns();
+    if (af->flush_due != 0 && now >= af->flush_due) {
+        STAT_ADD(bf->stats, auto_flushes, 1);
+        if (bf->writer)
+            flush_write_buffer(bf);
+        else
+            flush_handle(bf);
+        af->flush_due = 0;
+    }
+
+    uint64_t sync_due = autoflush_sync_due(bf);
+    if (sync_due != 0 && now >= sync_due) {
+        // Writes the flusher finished since the owner's last call are covered, ones still running wait
+        // for the next period
+        size_t written = 0;
+        if (bf->writer) {
+            pthread_mutex_lock(&bf->writer->lock);
+            written = writer_collect(bf->writer);
+            pthread_mutex_unlock(&bf->writer->lock);
+        }
+        bf->sync_pending += written;
+        // A failed sync is retried a period later instead of at once
+        if (bf->sync_pending != 0 && sync_handle(bf) == -1)
+            bf->sync_last = monotonic_ns();
+        else if (bf->sync_pending == 0)
+            bf->sync_last = now;
+    }
+}
+
+// Arm the handle's deadline for what it holds after a call or a timer pass, with the handle's lock held
+static void autoflush_arm(buffered_file_t *bf) {
+    struct buffered_autoflush *af = bf->autoflush;
+    if (!af->latency || !autoflush_pending(bf))
+        af->flush_due = 0;
+    else if (af->flush_due == 0)
+        af->flush_due = monotonic_ns() + af->latency;
+
+    uint64_t deadline = af->flush_due;
+    uint64_t sync_due = autoflush_sync_due(bf);
+    if (sync_due != 0 && (deadline == 0 || sync_due < deadline))
+        deadline = sync_due;
+    if (deadline == af->deadline)
+        return;
+
+    pthread_mutex_lock(&autoflush_lock);
+    af->deadline = deadline;
+    if (deadline != 0 && deadline < autoflush_next)
+        pthread_cond_signal(&autoflush_wake);
+    pthread_mutex_unlock(&autoflush_lock);
+}
+
+static void *autoflush_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&autoflush_lock);
+    while (autoflush_handles) {
+        uint64_t now = monotonic_ns();
+        uint64_t next = UINT64_MAX;
+        struct buffered_autoflush *due = NULL;
+        for (struct buffered_autoflush *af = autoflush_handles; af && !due; af = af->next) {
+            if (af->deadline == 0)
+                continue;
+            if (af->deadline > now) {
+                next = af->deadline < next ? af->deadline : next;
+            } else if (pthread_mutex_trylock(&af->lock) == 0) {
+                due = af;
+            }
+        }
+
+        if (due) {
+            // The handle's lock keeps it open while the registry is free for other handles
+            pthread_mutex_unlock(&autoflush_lock);
+            autoflush_flush(due->owner);
+            autoflush_arm(due->owner);
+            pthread_mutex_unlock(&due->lock);
+            pthread_mutex_lock(&autoflush_lock);
+            continue;
+        }
+
+        autoflush_next = next;
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&autoflush_wake, &autoflush_lock);
+        } else {
+            struct timespec ts = {(time_t) (next / 1000000000u), (long) (next % 1000000000u)};
+            pthread_cond_timedwait(&autoflush_wake, &autoflush_lock, &ts);
+        }
+    }
+    autoflush_running = 0;
+    pthread_mutex_unlock(&autoflush_lock);
+    return NULL;
+}
+
+// Put the handle under the shared timer, starting the timer thread when it is not running. A latency of
+// 0 times only the handle's group commit syncs
+static int autoflush_start(buffered_file_t *bf, unsigned latency_us) {
+    struct buffered_autoflush *af = (struct buffered_autoflush *)calloc(1, sizeof(struct buffered_autoflush));
+    if (!af)
+        return -1;
+    pthread_mutex_init(&af->lock, NULL);
+    af->owner = bf;
+    af->latency = (uint64_t) latency_us * 1000u;
+    pthread_once(&autoflush_once, autoflush_init);
+
+    pthread_mutex_lock(&autoflush_lock);
+    if (!autoflush_running) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, autoflush_main, NULL);
+        if (error) {
+            pthread_mutex_unlock(&autoflush_lock);
+            pthread_mutex_destroy(&af->lock);
+            free(af);
+            errno = error;
+            return -1;
+        }
+        pthread_detach(thread);
+        autoflush_running = 1;
+    }
+    af->next = autoflush_handles;
+    autoflush_handles = af;
+    pthread_mutex_unlock(&autoflush_lock);
+
+    bf->autoflush = af;
+    return 0;
+}
+
+// Take the handle out of the registry, once the timer is not flushing it
+static void autoflush_stop(buffered_file_t *bf) {
+    struct buffered_autoflush *af = bf->autoflush;
+    pthread_mutex_lock(&af->lock);
+    pthread_mutex_lock(&autoflush_lock);
+    struct buffered_autoflush **link = &autoflush_handles;
+    while (*link != af)
+        link = &(*link)->next;
+    *link = af->next;
+    if (!autoflush_handles)
+        pthread_cond_signal(&autoflush_wake);
+    pthread_mutex_unlock(&autoflush_lock);
+    pthread_mutex_unlock(&af->lock);
+
+    pthread_mutex_destroy(&af->lock);
+    free(af);
+    bf->autoflush = NULL;
+}
+
+// Start a public call on the handle, the timer cannot flush it until autoflush_leave
+static void autoflush_enter(buffered_file_t *bf) {
+    if (bf->autoflush)
+        pthread_mutex_lock(&bf->autoflush->lock);
+}
+
+// End a public call: catch up when the deadline passed during it, then arm or clear the deadline to
+// match what is left in the buffers
+static void autoflush_leave(buffered_file_t *bf) {
+    struct buffered_autoflush *af = bf->autoflush;
+    if (!af)
+        return;
+
+    if (af->deadline != 0 && monotonic_ns() >= af->deadline)
+        autoflush_flush(bf);
+    autoflush_arm(bf);
+    pthread_mutex_unlock(&af->lock);
+}
+
+static ssize_t write_handle(buffered_file_t *bf, const void *buf, size_t count) {
+    if ((bf->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (bf->coherent) {
+        return coherent_write(bf, buf, count);
+    }
+    if (bf->read_buffer_size != 0 && drop_read_buffer(bf) == -1) {
+        return -1;
+    }
+    if (bf->preappend) {
+        return pre_append_write(bf, buf, count);
+    }
+    if (bf->direct_align && bf->write_buffer_pos == 0 && count != 0 && direct_start_block(bf) == -1) {
+        return -1;
+    }
+    const char *data = buf;
+    size_t bytes_to_write = count;
+    size_t buffer_space = bf->write_buffer_size - bf->write_buffer_pos;
+
+    // Requests at least as large as the buffer go to the kernel in one writev together with
+    // the pending tail, instead of being copied through write_buffer piece by piece. Write-behind
+    // handles keep copying so the caller never waits on the device, and O_DIRECT needs aligned memory
+    if (!bf->writer && !bf->direct_align && bytes_to_write > buffer_space && bytes_to_write >= bf->write_buffer_size) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (bf->write_buffer_pos != 0) {
+            iov[iovcnt].iov_base = bf->write_buffer;
+            iov[iovcnt].iov_len = bf->write_buffer_pos;
+            iovcnt++;
+        }
+        iov[iovcnt].iov_base = (void *) data;
+        iov[iovcnt].iov_len = bytes_to_write;
+        iovcnt++;
+
+        uint64_t started = stats_clock(bf->stats);
+        off_t offset = write_buffer_offset(bf);
+        if (writev_all(bf->stats, bf->fd, iov, iovcnt) == -1) {
+            report_error("Failed to write to file");
+            return -1;
+        }
+        size_t written = bf->write_buffer_pos + bytes_to_write;
+        advance_file_offset(bf, written);
+        bf->write_buffer_pos = 0;
+        stats_flush(bf->stats, started);
+        durability_deferred(bf, offset, written);
+        return (ssize_t) count;
+    }
+
+    while (bytes_to_write > buffer_space) {
+        // Copy data to buffer
+        memcpy(bf->write_buffer + bf->write_buffer_pos, data, buffer_space);
+        bf->write_buffer_pos = bf->write_buffer_size;
+
+        // Update data to point to the next section to write.
+        data += buffer_space;
+        bytes_to_write -= buffer_space;
+
+        // Flush the buffer (flushing the buffer makes bf->write_buffer_pos = 0, except for the
+        // partial block O_DIRECT keeps)
+        if (flush_write_buffer(bf) == -1) {
+            return -1;
+        }
+
+        // Now the buffer is empty
+        buffer_space = bf->write_buffer_size - bf->write_buffer_pos;
+    }
+
+    // Copy the remaining data to buffer
+    memcpy(bf->write_buffer + bf->write_buffer_pos, data, bytes_to_write);
+    bf->write_buffer_pos += bytes_to_write;
+    return (ssize_t) count;
+}
+
+// The public read and write calls wrap their *_handle worker to count the call, the bytes asked for
+// and whether any syscall was needed
+ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t result = write_handle(bf, buf, count);
+    if (result > 0)
+        checksum_update(bf, buf, (size_t) result);
+    stats_end(bf->stats, 1, syscalls, count);
+    autoflush_leave(bf);
+    return result;
+}
+
+
+// Total length of an iovec array, -1 with EINVAL when it cannot be returned as a ssize_t
+static ssize_t iov_total(const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t) SSIZE_MAX - total) {
+            errno = EINVAL;
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return (ssize_t) total;
+}
+
+// Send the batch of pieces collected by buffered_writev. The buffered bytes it referenced are gone
+// afterwards, those packed after the last large piece move to the front of the buffer
+static int writev_batch(buffered_file_t *bf, struct iovec *batch, int *batch_count, size_t *packed) {
+    uint64_t started = stats_clock(bf->stats);
+    off_t offset = write_buffer_offset(bf);
+    ssize_t written = writev_all(bf->stats, bf->fd, batch, *batch_count);
+    if (written == -1) {
+        report_error("Failed to write to file");
+        return -1;
+    }
+    stats_flush(bf->stats, started);
+    advance_file_offset(bf, (size_t) written);
+    memmove(bf->write_buffer, bf->write_buffer + *packed, bf->write_buffer_pos - *packed);
+    bf->write_buffer_pos -= *packed;
+    *packed = 0;
+    *batch_count = 0;
+    return durability_written(bf, offset, (size_t) written);
+}
+
+static ssize_t writev_handle(buffered_file_t *bf, const struct iovec *iov, int iovcnt) {
+    if ((bf->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total == -1) {
+        return -1;
+    }
+
+    // Handles whose writes do not go through a plain write buffer take the pieces one by one
+    if (bf->coherent || bf->preappend || bf->direct_align || bf->writer) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (write_handle(bf, iov[i].iov_base, iov[i].iov_len) == -1)
+                return -1;
+        }
+        return total;
+    }
+    if (bf->read_buffer_size != 0 && drop_read_buffer(bf) == -1) {
+        return -1;
+    }
+
+    // Small pieces are packed into write_buffer, large ones are queued by reference. The batch lists
+    // buffered stretches and large pieces in file order, packed is where the unlisted buffered bytes start
+    struct iovec batch[IOV_MAX];
+    int batch_count = 0;
+    size_t packed = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const char *data = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+
+        if (length >= bf->write_buffer_size) {
+            if (bf->write_buffer_pos > packed) {
+                batch[batch_count].iov_base = bf->write_buffer + packed;
+                batch[batch_count].iov_len = bf->write_buffer_pos - packed;
+                batch_count++;
+                packed = bf->write_buffer_pos;
+            }
+            batch[batch_count].iov_base = (void *) data;
+            batch[batch_count].iov_len = length;
+            batch_count++;
+
+            // Room is kept for one more buffered stretch and one more large piece
+            if (batch_count >= IOV_MAX - 1 && writev_batch(bf, batch, &batch_count, &packed) == -1)
+                return -1;
+            continue;
+        }
+
+        while (length > 0) {
+            // A full buffer joins the batch and everything so far goes out
+            if (bf->write_buffer_pos == bf->write_buffer_size) {
+                batch[batch_count].iov_base = bf->write_buffer + packed;
+                batch[batch_count].iov_len = bf->write_buffer_pos - packed;
+                batch_count++;
+                packed = bf->write_buffer_pos;
+                if (writev_batch(bf, batch, &batch_count, &packed) == -1)
+                    return -1;
+            }
+
+            size_t copied = min(length, bf->write_buffer_size - bf->write_buffer_pos);
+            memcpy(bf->write_buffer + bf->write_buffer_pos, data, copied);
+            bf->write_buffer_pos += copied;
+            data += copied;
+            length -= copied;
+        }
+    }
+
+    // Large pieces are not held on to after the call, the small ones packed behind them can stay
+    if (batch_count != 0 && writev_batch(bf, batch, &batch_count, &packed) == -1) {
+        return -1;
+    }
+    return total;
+}
+
+ssize_t buffered_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t requested = bf->stats ? iov_total(iov, iovcnt) : 0;
+    ssize_t result = writev_handle(bf, iov, iovcnt);
+    if (result > 0)
+        checksum_update_iov(bf, iov, iovcnt, (size_t) result);
+    stats_end(bf->stats, 1, syscalls, requested == -1 ? 0 : (size_t) requested);
+    autoflush_leave(bf);
+    return result;
+}
+
+// Output of the printf fast path. Bytes past the capacity are counted but not stored, like vsnprintf
+struct format_sink {
+    char *out;
+    size_t capacity;
+    size_t length;
+};
+
+static void sink_put(struct format_sink *sink, const char *data, size_t count) {
+    if (sink->length < sink->capacity)
+        memcpy(sink->out + sink->length, data, min(count, sink->capacity - sink->length));
+    sink->length += count;
+}
+
+static void sink_pad(struct format_sink *sink, char c, size_t count) {
+    if (sink->length < sink->capacity)
+        memset(sink->out + sink->length, c, min(count, sink->capacity - sink->length));
+    sink->length += count;
+}
+
+// Write one converted field: sign or prefix, then digits, padded to width on the side the flags ask for
+static void sink_field(struct format_sink *sink, const char *sign, const char *body, size_t body_length,
+                       size_t width, int left, int zero) {
+    size_t sign_length = strlen(sign);
+    size_t padding = width > sign_length + body_length ? width - sign_length - body_length : 0;
+    if (!left && !zero)
+        sink_pad(sink, ' ', padding);
+    sink_put(sink, sign, sign_length);
+    if (!left && zero)
+        sink_pad(sink, '0', padding);
+    sink_put(sink, body, body_length);
+    if (left)
+        sink_pad(sink, ' ', padding);
+}
+
+// Digits of value in the given base, written backwards from end, returns where they start
+static char *format_digits(char *end, unsigned long long value, unsigned base, int upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[value % base];
+        value /= base;
+    } while (value != 0);
+    return end;
+}
+
+// Fixed-point %f for finite values whose scaled form fits in integer arithmetic. Returns the length of the
+// digits written backwards from end, or 0 to leave the value to vsnprintf: near a rounding tie the
+// product can be off by a fraction of a unit, and only the C library rounds those exactly
+static size_t format_fixed(char *end, double value, int precision) {
+    static const unsigned long long powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+                                                100000000, 1000000000};
+    long double scaled = (long double) fabs(value) * (long double) powers[precision];
+    if (!isfinite(value) || scaled >= (long double) (1ULL << (LDBL_MANT_DIG - 11)))
+        return 0;
+
+    unsigned long long whole = (unsigned long long) scaled;
+    long double fraction = scaled - (long double) whole;
+    if (fraction > 0.499L && fraction < 0.501L)
+        return 0;
+    if (fraction > 0.5L)
+        whole++;
+
+    char *start = end;
+    if (precision > 0) {
+        char *fraction_start = format_digits(end, whole % powers[precision], 10, 0);
+        while (end - fraction_start < precision)
+            *--fraction_start = '0';
+        start = fraction_start;
+        *--start = '.';
+    }
+    start = format_digits(start, whole / powers[precision], 10, 0);
+    return (size_t) (end - start);
+}
+
+// printf for what logging code mostly prints: %d %i %u %x %X %c %s %% and fixed-point %f, with the '-'
+// and '0' flags, a width, the l, ll and z lengths and a precision for %f and %s. Returns the length of
+// the full output, of which the first capacity bytes are stored, or -1 at the first conversion it does
+// not handle
+static ssize_t fast_format(char *dest, size_t capacity, const char *fmt, va_list ap) {
+    struct format_sink sink = {dest, capacity, 0};
+    while (*fmt) {
+        const char *literal = fmt;
+        while (*fmt && *fmt != '%')
+            fmt++;
+        sink_put(&sink, literal, (size_t) (fmt - literal));
+        if (!*fmt)
+            break;
+        fmt++;
+        if (*fmt == '%') {
+            sink_put(&sink, "%", 1);
+            fmt++;
+            continue;
+        }
+
+        int left = 0, zero = 0;
+        for (;; fmt++) {
+            if (*fmt == '-')
+                left = 1;
+            else if (*fmt == '0')
+                zero = 1;
+            else
+                break;
+        }
+        size_t width = 0;
+        while (*fmt >= '0' && *fmt <= '9')
+            width = width * 10 + (size_t) (*fmt++ - '0');
+        int precision = -1;
+        if (*fmt == '.') {
+            precision = 0;
+            fmt++;
+            while (*fmt >= '0' && *fmt <= '9' && precision < 100000)
+                precision = precision * 10 + (*fmt++ - '0');
+        }
+        int length = 0; // 1 for l, 2 for ll, 3 for z
+        if (*fmt == 'l') {
+            length = fmt[1] == 'l' ? 2 : 1;
+            fmt += length;
+        } else if (*fmt == 'z') {
+            length = 3;
+            fmt++;
+        }
+
+        char digits[72];
+        char *end = digits + sizeof(digits);
+        char conversion = *fmt++;
+        if (conversion == 'd' || conversion == 'i') {
+            long long value = length == 2 ? va_arg(ap, long long) : length == 1 ? va_arg(ap, long)
+                              : length == 3 ? va_arg(ap, ssize_t) : va_arg(ap, int);
+            if (precision >= 0)
+                return -1;
+            unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+            char *start = format_digits(end, magnitude, 10, 0);
+            sink_field(&sink, value < 0 ? "-" : "", start, (size_t) (end - start), width, left, zero);
+        } else if (conversion == 'u' || conversion == 'x' || conversion == 'X') {
+            unsigned long long value = length == 2 ? va_arg(ap, unsigned long long)
+                                       : length == 1 ? va_arg(ap, unsigned long)
+                                       : length == 3 ? va_arg(ap, size_t) : va_arg(ap, unsigned int);
+            if (precision >= 0)
+                return -1;
+            char *start = format_digits(end, value, conversion == 'u' ? 10 : 16, conversion == 'X');
+            sink_field(&sink, "", start, (size_t) (end - start), width, left, zero);
+        } else if (conversion == 'c' && length == 0 && precision < 0) {
+            char c = (char) va_arg(ap, int);
+            sink_field(&sink, "", &c, 1, width, left, 0);
+        } else if (conversion == 's' && length == 0) {
+            const char *text = va_arg(ap, const char *);
+            if (!text)
+                text = "(null)";
+            size_t text_length = precision >= 0 ? strnlen(text, (size_t) precision) : strlen(text);
+            sink_field(&sink, "", text, text_length, width, left, 0);
+        } else if (conversion == 'f' && length <= 1) {
+            double value = va_arg(ap, double);
+            size_t body_length = precision > 9 ? 0 : format_fixed(end, value, precision < 0 ? 6 : precision);
+            if (body_length == 0)
+                return -1;
+            sink_field(&sink, signbit(value) ? "-" : "", end - body_length, body_length, width, left, zero);
+        } else {
+            return -1;
+        }
+    }
+    return (ssize_t) sink.length;
+}
+
+// Format into dest, storing at most capacity bytes, and return the full length of the output. The fast
+// path is tried first and vsnprintf takes whatever it cannot handle
+static ssize_t format_into(char *dest, size_t capacity, const char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    ssize_t length = fast_format(dest, capacity, fmt, copy);
+    va_end(copy);
+    if (length != -1)
+        return length;
+
+    va_copy(copy, ap);
+    int formatted = vsnprintf(dest, capacity, fmt, copy);
+    va_end(copy);
+    return formatted;
+}
+
+static int vprintf_handle(buffered_file_t *bf, const char *fmt, va_list ap) {
+    if ((bf->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // Plain handles format into the free end of write_buffer and coherent ones into the free end of their
+    // window, flushing once and retrying when the record does not fit. Only records larger than the whole
+    // buffer, and O_PREAPPEND and O_DIRECT handles, format into separate memory first
+    if (!bf->preappend && !bf->direct_align) {
+        if (!bf->coherent && bf->read_buffer_size != 0 && drop_read_buffer(bf) == -1) {
+            return -1;
+        }
+        for (int attempt = 0; attempt < 2; attempt++) {
+            // A coherent window can only take the record at its end, bytes after the position are live data
+            if (bf->coherent && bf->read_buffer_pos != bf->read_buffer_size)
+                break;
+            char *dest = bf->coherent ? bf->read_buffer + bf->read_buffer_size : bf->write_buffer + bf->write_buffer_pos;
+            size_t capacity = bf->coherent ? bf->read_buffer_capacity : bf->write_buffer_size;
+            size_t space = bf->coherent ? capacity - bf->read_buffer_size : capacity - bf->write_buffer_pos;
+
+            ssize_t length = format_into(dest, space, fmt, ap);
+            if (length == -1)
+                return -1;
+            if ((size_t) length < space) {
+                checksum_update(bf, dest, (size_t) length);
+                if (bf->coherent) {
+                    coherent_mark(bf, bf->read_buffer_pos, (size_t) length);
+                    bf->read_buffer_pos += (size_t) length;
+                } else {
+                    bf->write_buffer_pos += (size_t) length;
+                }
+                return (int) length;
+            }
+            if ((size_t) length >= capacity)
+                break;
+
+            int flushed = bf->coherent ? coherent_move_window(bf, bf->file_offset) : flush_write_buffer(bf);
+            if (flushed == -1)
+                return -1;
+        }
+    }
+
+    // Short records are formatted on the stack, only long ones need the heap
+    char stack[256];
+    ssize_t length = format_into(stack, sizeof(stack), fmt, ap);
+    if (length == -1)
+        return -1;
+    char *record = stack;
+    if ((size_t) length >= sizeof(stack)) {
+        if (!(record = (char *)malloc((size_t) length + 1))) {
+            report_error("Failed to allocate memory for formatted output");
+            return -1;
+        }
+        format_into(record, (size_t) length + 1, fmt, ap);
+    }
+
+    ssize_t written = write_handle(bf, record, (size_t) length);
+    if (written != -1)
+        checksum_update(bf, record, (size_t) length);
+    if (record != stack)
+        free(record);
+    return written == -1 ? -1 : (int) length;
+}
+
+int buffered_vprintf(buffered_file_t *bf, const char *fmt, va_list ap) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    int result = vprintf_handle(bf, fmt, ap);
+    stats_end(bf->stats, 1, syscalls, result == -1 ? 0 : (size_t) result);
+    autoflush_leave(bf);
+    return result;
+}
+
+int buffered_printf(buffered_file_t *bf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int result = buffered_vprintf(bf, fmt, ap);
+    va_end(ap);
+    return result;
+}
+
+// Map the window of the file starting at map_pos, widened past BUFFER_MMAP_WINDOW when want bytes must be
+// visible at once. The file size is rechecked so readers see data appended since the last window,
+// returns 1 when a window was mapped, 0 at end of file and -1 on error
+static int map_window(buffered_file_t *bf, size_t want) {
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1) {
+        report_error("Failed to stat file");
+        return -1;
+    }
+    if (bf->map_pos >= st.st_size)
+        return 0;
+
+    if (bf->map_base) {
+        munmap(bf->map_base, bf->map_length);
+        bf->map_base = NULL;
+    }
+
+    off_t page_size = (off_t) sysconf(_SC_PAGESIZE);
+    off_t start = bf->map_pos - bf->map_pos % page_size;
+    size_t length = (size_t) (bf->map_pos - start) + want;
+    if (length < BUFFER_MMAP_WINDOW)
+        length = BUFFER_MMAP_WINDOW;
+    length = min(length, (size_t) (st.st_size - start));
+
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, bf->fd, start);
+    if (map == MAP_FAILED) {
+        report_error("Failed to map file");
+        return -1;
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+
+    bf->map_base = (char *) map;
+    bf->map_offset = start;
+    bf->map_length = length;
+    return 1;
+}
+
+// buffered_read for mmap mode, a memcpy out of the mapping with a new window mapped whenever the current one runs out
+static ssize_t mmap_read(buffered_file_t *bf, char *dest, size_t count) {
+    size_t bytes_read = 0;
+    while (bytes_read < count) {
+        if (!bf->map_base || bf->map_pos < bf->map_offset ||
+            bf->map_pos >= bf->map_offset + (off_t) bf->map_length) {
+            int mapped = map_window(bf, 0);
+            if (mapped == -1)
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            if (mapped == 0)
+                break;
+        }
+
+        size_t offset = (size_t) (bf->map_pos - bf->map_offset);
+        size_t length = min(count - bytes_read, bf->map_length - offset);
+        memcpy(dest + bytes_read, bf->map_base + offset, length);
+        bf->map_pos += (off_t) length;
+        bytes_read += length;
+    }
+    return (ssize_t) bytes_read;
+}
+
+// Keep the kernel reading ahead of a sequential reader. Every read that starts where the previous one
+// ended tops up a prefetched range with POSIX_FADV_WILLNEED once half of it is used, doubling the window
+// up to BUFFER_READAHEAD_MAX. A read anywhere else counts as random access and drops the window
+static void readahead_update(buffered_file_t *bf, off_t offset, size_t length) {
+    off_t end = offset + (off_t) length;
+
+    if (offset != bf->readahead_next) {
+        if (bf->readahead_end != -1) {
+            bf->readahead_window = 0;
+            bf->readahead_end = -1;
+            posix_fadvise(bf->fd, 0, 0, POSIX_FADV_RANDOM);
+        }
+        bf->readahead_next = end;
+        return;
+    }
+    bf->readahead_next = end;
+
+    if (bf->readahead_window == 0) {
+        // Coming back from random access (readahead_end is -1) the kernel's own readahead is re-enabled
+        if (bf->readahead_end == -1)
+            posix_fadvise(bf->fd, 0, 0, POSIX_FADV_NORMAL);
+        bf->readahead_window = BUFFER_READAHEAD_MIN;
+        bf->readahead_end = end;
+    }
+
+    if (bf->readahead_end - end < (off_t) bf->readahead_window / 2 && end < bf->read_file_size) {
+        off_t start = bf->readahead_end > end ? bf->readahead_end : end;
+        posix_fadvise(bf->fd, start, (off_t) bf->readahead_window, POSIX_FADV_WILLNEED);
+        bf->readahead_end = start + (off_t) bf->readahead_window;
+        if (bf->readahead_window < BUFFER_READAHEAD_MAX)
+            bf->readahead_window *= 2;
+    }
+}
+
+// Single read from the file at the handle's offset, all buffered_read traffic goes through here
+// The first read finds out whether the fd is a regular file, only those get readahead
+static void prepare_file_read(buffered_file_t *bf, size_t count) {
+    if (bf->read_regular == -1) {
+        struct stat st;
+        bf->read_regular = fstat(bf->fd, &st) == 0 && S_ISREG(st.st_mode);
+        bf->read_file_size = bf->read_regular ? st.st_size : 0;
+    }
+    if (bf->read_regular) {
+        readahead_update(bf, current_file_offset(bf), count);
+    }
+}
+
+static ssize_t read_from_file(buffered_file_t *bf, void *dest, size_t count) {
+    prepare_file_read(bf, count);
+
+    // Coherent handles read at the tracked offset, the fd offset is not kept in step with their window
+    ssize_t read_bytes;
+    if (bf->block_cache) {
+        read_bytes = cache_pread(bf, dest, count, bf->file_offset);
+    } else {
+        do {
+            read_bytes = bf->coherent ? pread(bf->fd, dest, count, bf->file_offset) : read(bf->fd, dest, count);
+            STAT_ADD(bf->stats, read_syscalls, 1);
+        } while (read_bytes == -1 && errno == EINTR);
+        if (read_bytes > 0)
+            STAT_ADD(bf->stats, kernel_bytes_read, read_bytes);
+    }
+
+    if (read_bytes > 0)
+        bf->file_offset += read_bytes;
+    return read_bytes;
+}
+
+// buffered_read for coherent handles. Pending writes are part of the window, so nothing is flushed
+// unless the window has to move
+static ssize_t coherent_read(buffered_file_t *bf, char *dest, size_t count) {
+    size_t bytes_read = 0;
+    while (bytes_read < count) {
+        if (bf->read_buffer_pos == bf->read_buffer_size) {
+            size_t rest = count - bytes_read;
+
+            // The rest of a request at least as large as the window is read straight into the caller's memory
+            if (rest >= bf->read_buffer_capacity) {
+                if (coherent_move_window(bf, bf->file_offset) == -1)
+                    return bytes_read ? (ssize_t) bytes_read : -1;
+                readahead_update(bf, bf->file_offset, rest);
+                ssize_t read_bytes = pread_full(bf->stats, bf->fd, dest + bytes_read, rest, bf->file_offset);
+                if (read_bytes == -1) {
+                    report_error("Failed to read from file");
+                    return bytes_read ? (ssize_t) bytes_read : -1;
+                }
+                bf->file_offset += read_bytes;
+                bytes_read += (size_t) read_bytes;
+                break;
+            }
+
+            // Grow the window in place while it has room, written bytes in it stay pending
+            if (bf->read_buffer_size == bf->read_buffer_capacity && coherent_move_window(bf, bf->file_offset) == -1)
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            ssize_t read_bytes = read_from_file(bf, bf->read_buffer + bf->read_buffer_size,
+                                                bf->read_buffer_capacity - bf->read_buffer_size);
+            if (read_bytes == -1) {
+                report_error("Failed to read from file");
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            }
+
+            // No more to read from the file
+            if (read_bytes == 0)
+                break;
+            bf->read_buffer_size += (size_t) read_bytes;
+        }
+
+        size_t length = min(bf->read_buffer_size - bf->read_buffer_pos, count - bytes_read);
+        memcpy(dest + bytes_read, bf->read_buffer + bf->read_buffer_pos, length);
+        bf->read_buffer_pos += length;
+        bytes_read += length;
+    }
+    return (ssize_t) bytes_read;
+}
+
+static ssize_t read_handle(buffered_file_t *bf, void *buf, size_t count) {
+    if ((bf->flags & O_ACCMODE) == O_WRONLY){
+        errno = EBADF;
+        return -1;
+    }
+    if (bf->mmap_mode) {
+        return mmap_read(bf, buf, count);
+    }
+    if (bf->coherent) {
+        return coherent_read(bf, buf, count);
+    }
+    // Data written through the handle has to reach the file before the file is read
+    if (writes_pending(bf) && flush_handle(bf) == -1) {
+        return -1;
+    }
+    if (bf->direct_align) {
+        return direct_read(bf, buf, count);
+    }
+    char *dest = buf;
+    size_t bytes_read = 0;
+
+    // Serve whatever is already sitting in the read buffer
+    size_t buffered = min(bf->read_buffer_size - bf->read_buffer_pos, count);
+    memcpy(dest, bf->read_buffer + bf->read_buffer_pos, buffered);
+    bf->read_buffer_pos += buffered;
+    bytes_read += buffered;
+
+    while (bytes_read < count) {
+        size_t bytes_to_read = count - bytes_read;
+
+        // The rest of a request at least as large as the buffer is read straight into the caller's memory
+        if (bytes_to_read >= bf->read_buffer_capacity) {
+            // The buffer no longer sits right before the fd offset, so it stops being a read window
+            bf->read_buffer_size = 0;
+            bf->read_buffer_pos = 0;
+
+            ssize_t read_bytes = read_from_file(bf, dest + bytes_read, bytes_to_read);
+            if (read_bytes == -1) {
+                report_error("Failed to read from file");
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            }
+
+            // No more to read from the file
+            if (read_bytes == 0)
+                break;
+            bytes_read += (size_t) read_bytes;
+
+            // Pipes and terminals hand back what has arrived so far, regular files are read until EOF
+            if ((size_t) read_bytes < bytes_to_read && !bf->read_regular)
+                break;
+            continue;
+        }
 
-// Helper function to allocate and initialize a buffered_file_t structure
-size_t min(size_t a, size_t b) {
-    if (a < b)
-        return a;
-    return b;
+        // Load read_buffer with new data
+        ssize_t read_bytes = read_from_file(bf, bf->read_buffer, bf->read_buffer_capacity);
+        if (read_bytes == -1) {
+            report_error("Failed to read from file");
+            return bytes_read ? (ssize_t) bytes_read : -1;
+        }
+        bf->read_buffer_size = (size_t) read_bytes;
+
+        size_t copied = min(bf->read_buffer_size, bytes_to_read);
+        memcpy(dest + bytes_read, bf->read_buffer, copied);
+        bf->read_buffer_pos = copied;
+        bytes_read += copied;
+
+        // No more to read from the file
+        if (read_bytes == 0)
+            break;
+        if (bf->read_buffer_size < bf->read_buffer_capacity && !bf->read_regular)
+            break;
+    }
+    return (ssize_t) bytes_read;
 }
 
-buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
-    buffered_file_t *bf = (buffered_file_t *)malloc(sizeof(buffered_file_t));
-    if (!bf) {
-        perror("Failed to allocate memory for buffered_file_t");
-        return NULL;
+ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t result = read_handle(bf, buf, count);
+    if (result > 0)
+        checksum_update(bf, buf, (size_t) result);
+    stats_end(bf->stats, 0, syscalls, count);
+    autoflush_leave(bf);
+    return result;
+}
+
+static ssize_t readv_handle(buffered_file_t *bf, const struct iovec *iov, int iovcnt) {
+    if ((bf->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total == -1) {
+        return -1;
     }
 
-    bf->read_buffer = (char *)malloc(BUFFER_SIZE);
-    bf->write_buffer = (char *)malloc(BUFFER_SIZE);
-    if (!bf->read_buffer || !bf->write_buffer) {
-        perror("Failed to allocate buffers");
-        free(bf->read_buffer);
-        free(bf->write_buffer);
-        free(bf);
-        return NULL;
+    // Handles that do not read through a plain read buffer fill the pieces one by one
+    if (bf->mmap_mode || bf->coherent || bf->direct_align) {
+        size_t bytes_read = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t read_bytes = read_handle(bf, iov[i].iov_base, iov[i].iov_len);
+            if (read_bytes == -1)
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            bytes_read += (size_t) read_bytes;
+            if ((size_t) read_bytes < iov[i].iov_len)
+                break;
+        }
+        return (ssize_t) bytes_read;
+    }
+    if (writes_pending(bf) && flush_handle(bf) == -1) {
+        return -1;
+    }
+
+    // Serve the pieces from the read buffer while it lasts
+    size_t bytes_read = 0;
+    int index = 0;
+    size_t done = 0; // Bytes of iov[index] already filled
+    while (index < iovcnt && bf->read_buffer_pos < bf->read_buffer_size) {
+        size_t length = min(bf->read_buffer_size - bf->read_buffer_pos, iov[index].iov_len - done);
+        memcpy((char *) iov[index].iov_base + done, bf->read_buffer + bf->read_buffer_pos, length);
+        bf->read_buffer_pos += length;
+        bytes_read += length;
+        done += length;
+        if (done == iov[index].iov_len) {
+            index++;
+            done = 0;
+        }
     }
 
+    // Less than a buffer's worth left is read piece by piece through the buffer
+    if ((size_t) total - bytes_read < bf->read_buffer_capacity) {
+        for (; index < iovcnt; index++, done = 0) {
+            ssize_t read_bytes = read_handle(bf, (char *) iov[index].iov_base + done, iov[index].iov_len - done);
+            if (read_bytes == -1)
+                return bytes_read ? (ssize_t) bytes_read : -1;
+            bytes_read += (size_t) read_bytes;
+            if ((size_t) read_bytes < iov[index].iov_len - done)
+                break;
+        }
+        return (ssize_t) bytes_read;
+    }
+
+    // Otherwise the remaining pieces and the empty read buffer are filled by one readv, so the data
+    // after the request is buffered by the same syscall
     bf->read_buffer_size = 0;
-    bf->write_buffer_size = BUFFER_SIZE;
     bf->read_buffer_pos = 0;
-    bf->write_buffer_pos = 0;
-    if (flags & O_PREAPPEND) {
-        bf->preappend = 1;
-    } else
-        bf->preappend = 0;
-    bf->flags = flags;
+    struct iovec batch[IOV_MAX];
+    while (index < iovcnt) {
+        int batch_count = 0;
+        int i = index;
+        for (; i < iovcnt && batch_count < IOV_MAX - 1; i++) {
+            size_t skip = i == index ? done : 0;
+            batch[batch_count].iov_base = (char *) iov[i].iov_base + skip;
+            batch[batch_count].iov_len = iov[i].iov_len - skip;
+            batch_count++;
+        }
+        // The read buffer only follows the caller's last piece, never one in the middle
+        if (i == iovcnt) {
+            batch[batch_count].iov_base = bf->read_buffer;
+            batch[batch_count].iov_len = bf->read_buffer_capacity;
+            batch_count++;
+        }
+
+        prepare_file_read(bf, (size_t) total - bytes_read);
+        ssize_t read_bytes;
+        do {
+            read_bytes = readv(bf->fd, batch, batch_count);
+            STAT_ADD(bf->stats, read_syscalls, 1);
+        } while (read_bytes == -1 && errno == EINTR);
+        if (read_bytes == -1) {
+            report_error("Failed to read from file");
+            return bytes_read ? (ssize_t) bytes_read : -1;
+        }
+        if (read_bytes == 0)
+            break;
+        bf->file_offset += read_bytes;
+        STAT_ADD(bf->stats, kernel_bytes_read, read_bytes);
 
-    // Remove O_PREAPPEND before calling the original open function
-    flags &= ~O_PREAPPEND;
+        // Walk the pieces the kernel filled, whatever went past them landed in the read buffer
+        size_t filled = (size_t) read_bytes;
+        while (index < iovcnt && filled >= iov[index].iov_len - done) {
+            filled -= iov[index].iov_len - done;
+            bytes_read += iov[index].iov_len - done;
+            index++;
+            done = 0;
+        }
+        if (index < iovcnt) {
+            done += filled;
+            bytes_read += filled;
+        } else {
+            bf->read_buffer_size = filled;
+        }
 
-    va_list args;
-    va_start(args, flags);
-    if (flags & O_CREAT) {
-        mode_t mode = va_arg(args, int);
-        bf->fd = open(pathname, flags, mode);
-    } else {
-        bf->fd = open(pathname, flags);
+        // Pipes and terminals hand back what has arrived so far, regular files are read until EOF
+        if (!bf->read_regular)
+            break;
     }
-    va_end(args);
+    return (ssize_t) bytes_read;
+}
 
-    if (bf->fd == -1) {
-        perror("Failed to open file");
-        free(bf->read_buffer);
-        free(bf->write_buffer);
-        free(bf);
-        return NULL;
+ssize_t buffered_readv(buffered_file_t *bf, const struct iovec *iov, int iovcnt) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t requested = bf->stats ? iov_total(iov, iovcnt) : 0;
+    ssize_t result = readv_handle(bf, iov, iovcnt);
+    if (result > 0)
+        checksum_update_iov(bf, iov, iovcnt, (size_t) result);
+    stats_end(bf->stats, 0, syscalls, requested == -1 ? 0 : (size_t) requested);
+    autoflush_leave(bf);
+    return result;
+}
+
+// buffered_peek for mmap mode, the view points straight into the mapping. A view that would cross the
+// end of the window gets a new window starting at the current position
+static int mmap_peek(buffered_file_t *bf, const char **ptr, size_t *len) {
+    size_t want = *len ? *len : 1;
+
+    if (!bf->map_base || bf->map_pos < bf->map_offset ||
+        bf->map_pos + (off_t) want > bf->map_offset + (off_t) bf->map_length) {
+        int mapped = map_window(bf, want);
+        if (mapped == -1)
+            return -1;
+        if (mapped == 0) {
+            *ptr = NULL;
+            *len = 0;
+            return 0;
+        }
     }
-    return bf;
+
+    size_t offset = (size_t) (bf->map_pos - bf->map_offset);
+    *ptr = bf->map_base + offset;
+    *len = bf->map_length - offset;
+    return 0;
 }
 
-ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
-    if (bf->flags == O_RDONLY) {
+static int peek_handle(buffered_file_t *bf, const char **ptr, size_t *len) {
+    if ((bf->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (bf->mmap_mode) {
+        return mmap_peek(bf, ptr, len);
+    }
+    if (!bf->coherent && writes_pending(bf) && flush_handle(bf) == -1) {
         return -1;
     }
-    size_t bytes_to_write = count;
-    size_t buffer_space = bf->write_buffer_size - bf->write_buffer_pos;
 
-    while (bytes_to_write > buffer_space) {
-        // Copy data to buffer
-        memcpy(bf->write_buffer + bf->write_buffer_pos, buf, buffer_space);
-        bf->write_buffer_pos = bf->write_buffer_size;
+    size_t want = *len ? *len : 1;
+    size_t available = bf->read_buffer_size - bf->read_buffer_pos;
 
-        // Flush the buffer (flushing the buffer makes bf->write_buffer_pos = 0)
-        if (buffered_flush(bf) == -1) {
+    if (available < want) {
+        // The window is about to be compacted and refilled, written bytes in it go out first
+        if (bf->coherent && coherent_flush(bf) == -1) {
             return -1;
         }
 
-        // Now the buffer is empty
-        buffer_space = bf->write_buffer_size;
+        // A record larger than the buffer makes the buffer grow to hold it. O_DIRECT windows start up
+        // to a block before the position and need aligned memory
+        size_t needed = bf->direct_align ? round_up(want, bf->direct_align) + bf->direct_align : want;
+        if (needed > bf->read_buffer_capacity && grow_read_buffer(bf, needed) == -1) {
+            return -1;
+        }
 
-        // Update buf to point to the next section to write.
-        buf += buffer_space;
-        bytes_to_write -= buffer_space;
+        if (bf->direct_align) {
+            if (direct_fill(bf, want) == -1) {
+                report_error("Failed to read from file");
+                return -1;
+            }
+        } else {
+            // Compact the unread bytes to the front so the view stays contiguous across the refill
+            memmove(bf->read_buffer, bf->read_buffer + bf->read_buffer_pos, available);
+            bf->read_buffer_pos = 0;
+            bf->read_buffer_size = available;
+
+            while (bf->read_buffer_size < want) {
+                ssize_t read_bytes = read_from_file(bf, bf->read_buffer + bf->read_buffer_size,
+                                                    bf->read_buffer_capacity - bf->read_buffer_size);
+                if (read_bytes == -1) {
+                    report_error("Failed to read from file");
+                    return -1;
+                }
+                if (read_bytes == 0)
+                    break;
+                bf->read_buffer_size += (size_t) read_bytes;
+            }
+        }
     }
 
-    // Copy the remaining data to buffer
-    memcpy(bf->write_buffer + bf->write_buffer_pos, buf, bytes_to_write);
-    bf->write_buffer_pos += bytes_to_write;
-    return (ssize_t) count;
+    *ptr = bf->read_buffer + bf->read_buffer_pos;
+    *len = bf->read_buffer_size - bf->read_buffer_pos;
+    return 0;
 }
 
+int buffered_peek(buffered_file_t *bf, const char **ptr, size_t *len) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    int result = peek_handle(bf, ptr, len);
+    stats_end(bf->stats, 0, syscalls, 0);
+    autoflush_leave(bf);
+    return result;
+}
 
-ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
-    if (bf->flags & O_WRONLY){
+static int consume_handle(buffered_file_t *bf, size_t n) {
+    if (bf->mmap_mode) {
+        // Only bytes the last peek exposed can be consumed, the same as the buffered path
+        size_t available = 0;
+        if ((bf->flags & O_ACCMODE) != O_WRONLY && bf->map_base && bf->map_pos >= bf->map_offset &&
+            bf->map_pos <= bf->map_offset + (off_t) bf->map_length)
+            available = bf->map_length - (size_t) (bf->map_pos - bf->map_offset);
+        if (n > available) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (n)
+            checksum_update(bf, bf->map_base + (bf->map_pos - bf->map_offset), n);
+        bf->map_pos += (off_t) n;
+        STAT_ADD(bf->stats, bytes_read, n);
+        return 0;
+    }
+
+    if (n > bf->read_buffer_size - bf->read_buffer_pos) {
+        errno = EINVAL;
         return -1;
     }
-    size_t bytes_to_read = count;   // maximum bytes to read
-    size_t buffer_space = bf->read_buffer_size - bf->read_buffer_pos;
+    checksum_update(bf, bf->read_buffer + bf->read_buffer_pos, n);
+    bf->read_buffer_pos += n;
+    STAT_ADD(bf->stats, bytes_read, n);
+    return 0;
+}
 
-    while (buffer_space < bytes_to_read) {
-        // Copy data from buffer
-        memcpy(buf, bf->read_buffer + bf->read_buffer_pos, buffer_space);
-        bytes_to_read -= buffer_space;
-        buf += buffer_space;
+int buffered_consume(buffered_file_t *bf, size_t n) {
+    autoflush_enter(bf);
+    int result = consume_handle(bf, n);
+    autoflush_leave(bf);
+    return result;
+}
 
-        // Load read_buffer with new data
-        bf->read_buffer_pos = 0;
-        bf->read_buffer_size = read(bf->fd, bf->read_buffer, BUFFER_SIZE);
-        if (bf->read_buffer_size == -1)
-            perror("Failed to read from file");
-        buffer_space = bf->read_buffer_size;
+static ssize_t read_until_handle(buffered_file_t *bf, int delim, void *buf, size_t count) {
+    char *dest = buf;
+    size_t bytes_read = 0;
 
-        // No more to read from the file
-        if (bf->read_buffer_size < BUFFER_SIZE) {
+    while (bytes_read < count) {
+        const char *view;
+        size_t length = 0;
+        if (peek_handle(bf, &view, &length) == -1)
+            return bytes_read ? (ssize_t) bytes_read : -1;
+
+        // End of file
+        if (length == 0)
+            break;
+
+        // Scan the buffered bytes in place and copy out only what belongs to this record
+        length = min(length, count - bytes_read);
+        const char *found = memchr(view, (unsigned char) delim, length);
+        size_t taken = found ? (size_t) (found - view) + 1 : length;
+
+        memcpy(dest + bytes_read, view, taken);
+        consume_handle(bf, taken);
+        bytes_read += taken;
+        if (found)
             break;
+    }
+    return (ssize_t) bytes_read;
+}
+
+ssize_t buffered_read_until(buffered_file_t *bf, int delim, void *buf, size_t count) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t result = read_until_handle(bf, delim, buf, count);
+    stats_end(bf->stats, 0, syscalls, 0);
+    autoflush_leave(bf);
+    return result;
+}
+
+ssize_t buffered_readline(buffered_file_t *bf, void *buf, size_t count) {
+    return buffered_read_until(bf, '\n', buf, count);
+}
+
+// buffered_lseek for coherent handles. Only the tracked position moves, the window is written back
+// just when the target lies outside it
+static off_t coherent_lseek(buffered_file_t *bf, off_t offset, int whence) {
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+    off_t target = offset;
+    if (whence == SEEK_CUR) {
+        target = window_start + (off_t) bf->read_buffer_pos + offset;
+    } else if (whence == SEEK_END) {
+        // The window may have grown the file past what the kernel knows about
+        struct stat st;
+        if (fstat(bf->fd, &st) == -1) {
+            report_error("Failed to stat file");
+            return -1;
         }
+        target = st.st_size;
+        if (bf->read_buffer_size != 0 && bf->file_offset > target)
+            target = bf->file_offset;
+        target += offset;
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (target < 0) {
+        errno = EINVAL;
+        return -1;
     }
 
-    size_t remain_bytes_to_read = min(buffer_space, bytes_to_read);
-    memcpy(buf, bf->read_buffer + bf->read_buffer_pos, remain_bytes_to_read);
-    bf->read_buffer_pos += remain_bytes_to_read;
-    return (ssize_t) count - bytes_to_read + remain_bytes_to_read; // bytes_read
+    if (target >= window_start && target <= bf->file_offset) {
+        bf->read_buffer_pos = (size_t) (target - window_start);
+        return target;
+    }
+    if (coherent_move_window(bf, target) == -1)
+        return -1;
+    return target;
 }
 
-int flush_pre_append(buffered_file_t *bf) {
-    if (bf->write_buffer_pos == 0)
-        return 0;
+static off_t seek_handle(buffered_file_t *bf, off_t offset, int whence) {
+    if (bf->mmap_mode) {
+        off_t base = bf->map_pos;
+        if (whence == SEEK_SET) {
+            base = 0;
+        } else if (whence == SEEK_END) {
+            struct stat st;
+            if (fstat(bf->fd, &st) == -1) {
+                report_error("Failed to stat file");
+                return -1;
+            }
+            base = st.st_size;
+        } else if (whence != SEEK_CUR) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (base + offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        bf->map_pos = base + offset;
+        return bf->map_pos;
+    }
+
+    if (bf->coherent) {
+        return coherent_lseek(bf, offset, whence);
+    }
 
-    // Get the number of bytes to flush.
-    size_t buf_size = bf->write_buffer_pos;
+    // Where the caller is: the fd offset less what is read ahead plus what is not written yet
+    off_t current = bf->file_offset - (off_t) (bf->read_buffer_size - bf->read_buffer_pos) +
+                    (off_t) (bf->write_buffer_pos + bf->prepend_buffer_pos);
+    off_t target = -1;
+    if (whence == SEEK_SET)
+        target = offset;
+    else if (whence == SEEK_CUR)
+        target = current + offset;
+    else if (whence != SEEK_END) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    // Save current position
-    off_t current_pos = lseek(bf->fd, 0, SEEK_CUR);
+    // Staying put costs nothing, pending writes are only flushed when the position actually moves
+    if (target == current && bf->file_offset != -1)
+        return current;
 
-    // Create temp txt file
-    int temp_fd = open("temp_file.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (temp_fd == -1) {
-        perror("Failed to open temporary file");
+    if (writes_pending(bf) && flush_handle(bf) == -1)
+        return -1;
+
+    if (whence == SEEK_END) {
+        STAT_ADD(bf->stats, seek_syscalls, 1);
+        target = lseek(bf->fd, offset, SEEK_END);
+        if (target == -1) {
+            report_error("Failed to seek file");
+            return -1;
+        }
+        bf->file_offset = target;
+        bf->read_buffer_size = 0;
+        bf->read_buffer_pos = 0;
+        return target;
+    }
+    if (bf->file_offset == -1) {
+        // O_APPEND writes moved the fd, SEEK_CUR is relative to where they left it
+        if (current_file_offset(bf) == -1) {
+            report_error("Failed to seek file");
+            return -1;
+        }
+        if (whence == SEEK_CUR)
+            target = bf->file_offset + offset;
+    }
+    if (target < 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    // Flush the buffer to that file
-    ssize_t written_bytes = write(temp_fd, bf->write_buffer, buf_size);
-    if (written_bytes == -1) {
-        perror("Failed to write buffer content to temporary file");
-        close(temp_fd);
+    // A target inside the read window reuses the buffered data without a syscall
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+    if (bf->read_buffer_size != 0 && target >= window_start && target <= bf->file_offset) {
+        bf->read_buffer_pos = (size_t) (target - window_start);
+        return target;
+    }
+
+    STAT_ADD(bf->stats, seek_syscalls, 1);
+    if (lseek(bf->fd, target, SEEK_SET) == -1) {
+        report_error("Failed to seek file");
         return -1;
     }
+    bf->file_offset = target;
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    return target;
+}
 
-    // Reset buffer position
-    bf->write_buffer_pos = 0;
+// buffered_lseek for read-only handles showing a prefix log. Logical offsets are base file offsets
+// shifted by the prefix, which lives in the read window at base offsets [-prefix_length, 0)
+static off_t prefix_lseek(buffered_file_t *bf, off_t offset, int whence) {
+    off_t shift = (off_t) bf->prefix_length;
+    off_t target = offset;
+    if (whence == SEEK_CUR) {
+        target += bf->file_offset - (off_t) (bf->read_buffer_size - bf->read_buffer_pos) + shift;
+    } else if (whence == SEEK_END) {
+        struct stat st;
+        if (fstat(bf->fd, &st) == -1) {
+            report_error("Failed to stat file");
+            return -1;
+        }
+        target += st.st_size + shift;
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (target < 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    // Copy from bf->fd to temp_fd
-    char buffer[BUFFER_SIZE];
-    ssize_t read_bytes;
-    while ((read_bytes = read(bf->fd, buffer, BUFFER_SIZE)) > 0) {
-        written_bytes = write(temp_fd, buffer, read_bytes);
-        if (written_bytes == -1) {
-            perror("Failed to write existing data to temporary file");
-            close(temp_fd);
+    if (target >= shift) {
+        off_t result = seek_handle(bf, target - shift, SEEK_SET);
+        return result == -1 ? -1 : result + shift;
+    }
+
+    // Inside the prefix the window is reused while it still holds that part, otherwise it is reloaded
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+    if (target - shift < window_start) {
+        STAT_ADD(bf->stats, seek_syscalls, 1);
+        if (lseek(bf->fd, 0, SEEK_SET) == -1) {
+            report_error("Failed to seek file");
             return -1;
         }
+        memcpy(bf->read_buffer, bf->prefix_data, bf->prefix_length);
+        bf->read_buffer_size = bf->prefix_length;
+        bf->file_offset = 0;
+        window_start = -shift;
     }
+    bf->read_buffer_pos = (size_t) (target - shift - window_start);
+    return target;
+}
 
-    if (read_bytes == -1) {
-        perror("Failed to read existing data from original file");
-        close(temp_fd);
+off_t buffered_lseek(buffered_file_t *bf, off_t offset, int whence) {
+    autoflush_enter(bf);
+    off_t result = bf->prefix_length ? prefix_lseek(bf, offset, whence) : seek_handle(bf, offset, whence);
+    autoflush_leave(bf);
+    return result;
+}
+
+// Whether [offset, offset + count) overlaps data still pending in the write buffers or the dirty part of
+// a coherent window. O_APPEND and write-behind data has no fixed place yet, so it counts as overlapping everything
+static int overlaps_pending_writes(buffered_file_t *bf, off_t offset, size_t count) {
+    if (!writes_pending(bf))
+        return 0;
+    if (bf->coherent) {
+        off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+        return offset < window_start + (off_t) bf->dirty_end && offset + (off_t) count > window_start + (off_t) bf->dirty_start;
+    }
+    if (bf->prepend_buffer_pos != 0 || bf->writer || bf->file_offset == -1)
+        return 1;
+    return offset < bf->file_offset + (off_t) bf->write_buffer_pos && offset + (off_t) count > bf->file_offset;
+}
+
+static ssize_t pread_handle(buffered_file_t *bf, void *buf, size_t count, off_t offset) {
+    if ((bf->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
         return -1;
     }
 
-    // Go back to current_pos
-    lseek(bf->fd, current_pos, SEEK_SET);
+    // With a prefix log the part of the range inside the prefix comes from memory, the rest from the file
+    if (bf->prefix_length) {
+        off_t shift = (off_t) bf->prefix_length;
+        if (offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (offset < shift) {
+            size_t head = min(count, (size_t) (shift - offset));
+            memcpy(buf, bf->prefix_data + offset, head);
+            if (head == count)
+                return (ssize_t) count;
+            ssize_t rest = pread_handle(bf, (char *) buf + head, count - head, shift);
+            return rest == -1 ? (ssize_t) head : (ssize_t) head + rest;
+        }
+        offset -= shift;
+    }
 
-    // Copy from temp_fd to bf->fd
-    lseek(temp_fd, 0, SEEK_SET); // Move to the start of the temp file
-    while ((read_bytes = read(temp_fd, buffer, BUFFER_SIZE)) > 0) {
-        written_bytes = write(bf->fd, buffer, read_bytes);
-        if (written_bytes == -1) {
-            perror("Failed to write back to the original file");
-            close(temp_fd);
+    // Served from the mapping or the read window when they already hold the whole range
+    if (bf->mmap_mode) {
+        if (bf->map_base && offset >= bf->map_offset &&
+            offset + (off_t) count <= bf->map_offset + (off_t) bf->map_length) {
+            memcpy(buf, bf->map_base + (offset - bf->map_offset), count);
+            return (ssize_t) count;
+        }
+    } else {
+        if (overlaps_pending_writes(bf, offset, count) && flush_handle(bf) == -1)
             return -1;
+
+        off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+        if (bf->read_buffer_size != 0 && offset >= window_start &&
+            offset + (off_t) count <= bf->file_offset) {
+            memcpy(buf, bf->read_buffer + (offset - window_start), count);
+            return (ssize_t) count;
         }
     }
 
+    // Like buffered reads, only requests smaller than the read buffer go through the block cache
+    ssize_t read_bytes;
+    if (bf->direct_align)
+        read_bytes = direct_pread(bf, buf, count, offset);
+    else if (bf->block_cache && count < bf->read_buffer_capacity)
+        read_bytes = cache_pread(bf, buf, count, offset);
+    else
+        read_bytes = pread_full(bf->stats, bf->fd, buf, count, offset);
     if (read_bytes == -1) {
-        perror("Failed to read from temporary file");
-        close(temp_fd);
+        report_error("Failed to read from file");
         return -1;
     }
+    return read_bytes;
+}
 
-    // Close and delete temp_fd
-    close(temp_fd);
-    remove("temp_file.txt");
+ssize_t buffered_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t result = pread_handle(bf, buf, count, offset);
+    stats_end(bf->stats, 0, syscalls, count);
+    autoflush_leave(bf);
+    return result;
+}
 
-    // Get to the current position
-    lseek(bf->fd, current_pos + buf_size, SEEK_SET);
-    return 0;
+static ssize_t pwrite_handle(buffered_file_t *bf, const void *buf, size_t count, off_t offset) {
+    if ((bf->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Positional writes go straight to the file, so threads sharing a handle for positional I/O never
+    // touch the window. Pending data would land on top of this write later, so it goes out first
+    if (overlaps_pending_writes(bf, offset, count) && flush_handle(bf) == -1)
+        return -1;
+
+    int written = bf->direct_align ? direct_pwrite(bf, buf, count, offset)
+                                   : pwrite_all(bf->stats, bf->fd, buf, count, offset);
+    if (written == -1) {
+        report_error("Failed to write to file");
+        return -1;
+    }
+    if (durability_written(bf, offset, count) == -1)
+        return -1;
+
+    // Keep the read window in step with what was just written
+    off_t window_start = bf->file_offset - (off_t) bf->read_buffer_size;
+    off_t start = offset > window_start ? offset : window_start;
+    off_t end = offset + (off_t) count < bf->file_offset ? offset + (off_t) count : bf->file_offset;
+    if (bf->read_buffer_size != 0 && start < end) {
+        memcpy(bf->read_buffer + (start - window_start), (const char *) buf + (start - offset), (size_t) (end - start));
+    }
+    return (ssize_t) count;
+}
+
+ssize_t buffered_pwrite(buffered_file_t *bf, const void *buf, size_t count, off_t offset) {
+    autoflush_enter(bf);
+    uint64_t syscalls = stats_begin(bf->stats);
+    ssize_t result = pwrite_handle(bf, buf, count, offset);
+    stats_end(bf->stats, 1, syscalls, count);
+    autoflush_leave(bf);
+    return result;
 }
 
+// Move up to count bytes from in_fd to out_fd at their fd offsets. copy_file_range is tried first, then
+// sendfile, then splice through a pipe, each falling back to the next where the kernel refuses the pair
+// of files, and a plain read/write loop comes last (and first for O_APPEND outputs). Stops early at the end of the input, returns the bytes
+// moved or -1 when an error came before any
+static ssize_t kernel_copy(buffered_stats_t *stats, int in_fd, int out_fd, size_t count) {
+    // None of the zero-copy calls write to O_APPEND files
+    enum { COPY_RANGE, SENDFILE, SPLICE, BOUNCE } method = fcntl(out_fd, F_GETFL) & O_APPEND ? BOUNCE : COPY_RANGE;
+    int pipe_fds[2] = { -1, -1 };
+    char *bounce = NULL;
+    size_t total = 0;
+    int failed = 0;
 
-int buffered_flush(buffered_file_t *bf) {
+    while (total < count) {
+        size_t chunk = min(count - total, BUFFER_SHIFT_CHUNK);
+        ssize_t moved = -1;
+        if (method == COPY_RANGE) {
+            moved = copy_file_range(in_fd, NULL, out_fd, NULL, chunk, 0);
+            // Older kernels refuse copies across filesystems, special files and O_APPEND outputs
+            if (moved == -1 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS ||
+                                errno == EBADF)) {
+                method = SENDFILE;
+                continue;
+            }
+        } else if (method == SENDFILE) {
+            moved = sendfile(out_fd, in_fd, NULL, chunk);
+            if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                method = SPLICE;
+                continue;
+            }
+        } else if (method == SPLICE) {
+            if (pipe_fds[0] == -1 && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                failed = 1;
+                break;
+            }
+            moved = splice(in_fd, NULL, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINVAL) {
+                method = BOUNCE;
+                continue;
+            }
+            // What entered the pipe has to come out again, or it would be lost. An output that refuses
+            // splice gets it through memory, and so does the rest of the copy
+            for (ssize_t left = moved; left > 0;) {
+                ssize_t out = splice(pipe_fds[0], NULL, out_fd, NULL, (size_t) left, SPLICE_F_MOVE);
+                STAT_ADD(stats, write_syscalls, 1);
+                if (out == -1 && errno == EINVAL && (bounce || (bounce = (char *)malloc(BUFFER_SHIFT_CHUNK)))) {
+                    method = BOUNCE;
+                    out = read(pipe_fds[0], bounce, (size_t) left);
+                    if (out > 0 && write_all(stats, out_fd, bounce, (size_t) out) == -1)
+                        out = -1;
+                }
+                if (out == -1 && errno == EINTR)
+                    continue;
+                if (out <= 0) {
+                    moved = -1;
+                    break;
+                }
+                left -= out;
+            }
+        } else {
+            if (!bounce && !(bounce = (char *)malloc(BUFFER_SHIFT_CHUNK))) {
+                failed = 1;
+                break;
+            }
+            moved = read(in_fd, bounce, chunk);
+            STAT_ADD(stats, read_syscalls, 1);
+            if (moved > 0 && write_all(stats, out_fd, bounce, (size_t) moved) == -1)
+                moved = -1;
+        }
+        if (method != BOUNCE)
+            STAT_ADD(stats, write_syscalls, 1);
+
+        if (moved == -1 && errno == EINTR)
+            continue;
+        if (moved <= 0) {
+            failed = moved == -1;
+            break;
+        }
+        STAT_ADD(stats, kernel_bytes_written, moved);
+        total += (size_t) moved;
+    }
+
+    int error = errno;
+    if (pipe_fds[0] != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    free(bounce);
+    errno = error;
+    return failed && total == 0 ? -1 : (ssize_t) total;
+}
+
+static ssize_t copy_handle(buffered_file_t *dst, buffered_file_t *src, size_t len) {
+    if ((src->flags & O_ACCMODE) == O_WRONLY || (dst->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // Whatever src has read ahead goes to dst through its write buffer first
+    size_t copied = 0;
+    if (!src->mmap_mode) {
+        copied = min(src->read_buffer_size - src->read_buffer_pos, len);
+        if (copied && write_handle(dst, src->read_buffer + src->read_buffer_pos, copied) == -1)
+            return -1;
+        src->read_buffer_pos += copied;
+    }
+
+    // Prepends and O_DIRECT cannot take data from the kernel, those copies go through src's read buffer
+    if (dst->preappend || dst->direct_align || src->direct_align) {
+        while (copied < len) {
+            const char *view;
+            size_t view_len = 0;
+            if (peek_handle(src, &view, &view_len) == -1)
+                return copied ? (ssize_t) copied : -1;
+            if (view_len == 0)
+                break;
+            size_t length = min(view_len, len - copied);
+            if (write_handle(dst, view, length) == -1)
+                return copied ? (ssize_t) copied : -1;
+            if (src->mmap_mode)
+                src->map_pos += (off_t) length;
+            else
+                src->read_buffer_pos += length;
+            copied += length;
+        }
+        return (ssize_t) copied;
+    }
+    if (copied == len)
+        return (ssize_t) copied;
+
+    // Bring both fd offsets to the handles' positions with nothing left in their buffers. Coherent and
+    // mapped handles do not keep the fd offset in step, so theirs is set explicitly
+    off_t src_position;
+    if (src->mmap_mode) {
+        src_position = src->map_pos;
+    } else if (src->coherent) {
+        src_position = src->file_offset;
+        if (coherent_move_window(src, src_position) == -1)
+            return copied ? (ssize_t) copied : -1;
+    } else {
+        if (writes_pending(src) && flush_handle(src) == -1)
+            return copied ? (ssize_t) copied : -1;
+        src->read_buffer_size = 0;
+        src->read_buffer_pos = 0;
+        src_position = current_file_offset(src);
+    }
+
+    off_t dst_position;
+    if (dst->coherent) {
+        dst_position = dst->file_offset - (off_t) (dst->read_buffer_size - dst->read_buffer_pos);
+        if (coherent_move_window(dst, dst_position) == -1)
+            return copied ? (ssize_t) copied : -1;
+    } else {
+        if (flush_handle(dst) == -1 || (dst->read_buffer_size != 0 && drop_read_buffer(dst) == -1))
+            return copied ? (ssize_t) copied : -1;
+        dst_position = write_buffer_offset(dst);
+    }
+
+    if (((src->mmap_mode || src->coherent) && lseek(src->fd, src_position, SEEK_SET) == -1) ||
+        (dst->coherent && lseek(dst->fd, dst_position, SEEK_SET) == -1)) {
+        report_error("Failed to seek file");
+        return copied ? (ssize_t) copied : -1;
+    }
+
+    ssize_t moved = kernel_copy(dst->stats, src->fd, dst->fd, len - copied);
+    if (moved == -1) {
+        report_error("Failed to copy between files");
+        return copied ? (ssize_t) copied : -1;
+    }
+
+    if (src->mmap_mode)
+        src->map_pos = src_position + moved;
+    else if (src_position != -1)
+        src->file_offset = src_position + moved;
+    if (dst->coherent)
+        dst->file_offset = dst_position + moved;
+    else
+        advance_file_offset(dst, (size_t) moved);
+    if (durability_written(dst, dst_position, (size_t) moved) == -1)
+        return -1;
+    return (ssize_t) (copied + (size_t) moved);
+}
+
+ssize_t buffered_copy(buffered_file_t *dst, buffered_file_t *src, size_t len) {
+    if (src == dst) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Both locks are taken lowest address first, so copies running in opposite directions between the
+    // same two handles cannot each hold one lock and wait for the other
+    buffered_file_t *first = (uintptr_t) dst < (uintptr_t) src ? dst : src;
+    buffered_file_t *second = first == dst ? src : dst;
+    autoflush_enter(first);
+    autoflush_enter(second);
+    ssize_t result = copy_handle(dst, src, len);
+    autoflush_leave(second);
+    autoflush_leave(first);
+    return result;
+}
+
+uint32_t buffered_checksum(buffered_file_t *bf) {
+    return bf->checksum ? ~bf->checksum_state : 0;
+}
+
+int buffered_stats(buffered_file_t *bf, buffered_stats_t *out) {
+    if (!bf->stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Every field is a uint64_t counter, each is loaded on its own
+    const uint64_t *from = (const uint64_t *) bf->stats;
+    uint64_t *to = (uint64_t *) out;
+    for (size_t i = 0; i < sizeof(buffered_stats_t) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Hand everything the handle holds to the kernel, without applying the flush durability policy
+static int flush_handle(buffered_file_t *bf) {
     if (bf->preappend) {
         return flush_pre_append(bf);
     }
+    if (bf->coherent) {
+        return coherent_flush(bf);
+    }
 
-    if (bf->write_buffer_pos != 0){
-        ssize_t written_bytes = write(bf->fd, bf->write_buffer, bf->write_buffer_pos);
-        if (written_bytes == -1) {
-            perror("Failed to write to file");
+    if (flush_write_buffer(bf) == -1) {
+        return -1;
+    }
+
+    // O_DIRECT keeps a partial last block in the buffer, an explicit flush writes it out padded to
+    // a whole block and leaves the position right after the data
+    if (bf->direct_align && bf->write_buffer_pos != 0) {
+        uint64_t started = stats_clock(bf->stats);
+        if (direct_pwrite(bf, bf->write_buffer, bf->write_buffer_pos, bf->file_offset) == -1) {
+            report_error("Failed to write to file");
             return -1;
         }
-        bf->write_buffer_pos = 0; // Reset the buffer position
+        off_t offset = bf->file_offset;
+        size_t length = bf->write_buffer_pos;
+        bf->file_offset += (off_t) length;
+        bf->write_buffer_pos = 0;
+        stats_flush(bf->stats, started);
+        if (durability_written(bf, offset, length) == -1)
+            return -1;
+    }
+
+    // In write-behind mode a flush also waits for everything queued before it
+    if (bf->writer) {
+        return writer_wait(bf);
+    }
+    return 0;
+}
+
+// flush_handle followed by the flush durability policy
+static int flush_durable(buffered_file_t *bf) {
+    if (flush_handle(bf) == -1 || durability_owed(bf) == -1) {
+        return -1;
+    }
+    // Only data this handle actually wrote is synced, flushing a clean handle stays free
+    if (bf->durability == BUFFER_DURABILITY_FLUSH && bf->sync_pending != 0) {
+        return sync_handle(bf);
     }
     return 0;
 }
 
+int buffered_flush(buffered_file_t *bf) {
+    autoflush_enter(bf);
+    int result = flush_durable(bf);
+    autoflush_leave(bf);
+    return result;
+}
+
+int buffered_sync(buffered_file_t *bf) {
+    autoflush_enter(bf);
+    int result = flush_handle(bf) == -1 || durability_owed(bf) == -1 ? -1 : sync_handle(bf);
+    autoflush_leave(bf);
+    return result;
+}
 
 int buffered_close(buffered_file_t *bf) {
     if (buffered_flush(bf) == -1) {
-        perror("Failed to flush before closing");
+        report_error("Failed to flush before closing");
+        return -1;
+    }
+
+    // Nothing is buffered any more, the timer can let go of the handle
+    if (bf->autoflush) {
+        autoflush_stop(bf);
+    }
+
+    // The last group commit period ends with the handle
+    if (bf->durability == BUFFER_DURABILITY_GROUP && bf->sync_pending != 0 && sync_handle(bf) == -1) {
+        report_error("Failed to sync before closing");
         return -1;
     }
 
+    if (bf->writer) {
+        writer_stop(bf);
+    }
+
     if (close(bf->fd) == -1) {
-        perror("Failed to close file");
+        report_error("Failed to close file");
         return -1;
     }
 
-    free(bf->read_buffer);
-    free(bf->write_buffer);
-    free(bf);
+    if (bf->map_base)
+        munmap(bf->map_base, bf->map_length);
+    if (bf->prefix_log)
+        close(bf->prefix_fd);
+    free(bf->prefix_data);
+    free(bf->stats);
+    if (bf->read_buffer_heap)
+        free(bf->read_buffer);
+    free(bf->prepend_buffer);
+    free(bf->pathname);
+    release_handle(bf);
     return 0;
 }
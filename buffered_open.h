@@ -3,21 +3,127 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Define a new flag that doesn't collide with existing flags
 #define O_PREAPPEND 0x40000000
 
+// Flag for read-only handles: serve buffered_read straight out of a memory mapping of the file
+#define O_MMAP 0x20000000
+
 // Define the standard buffer size for read and write operations
 #define BUFFER_SIZE 4096
 
+// Upper bound for buffers sized automatically from the file's block size and length
+#define BUFFER_AUTO_MAX (1 << 20)
+
+// Minimum number of filesystem blocks an automatically sized write buffer holds
+#define BUFFER_AUTO_BLOCKS 16
+
+// Pending O_PREAPPEND data is inserted into the file once this much has accumulated
+#define BUFFER_PREPEND_MAX (64 << 20)
+
+// Size of the chunks used to move existing data when O_PREAPPEND has to shift the file
+#define BUFFER_SHIFT_CHUNK (1 << 20)
+
+// Suffix of the sidecar log holding lazily prepended data, see the prepend_log option
+#define BUFFER_PREFIX_SUFFIX ".prefix"
+
+// Largest window of the file mapped at once in O_MMAP mode, keeping huge files within the address space
+#if UINTPTR_MAX > 0xffffffffu
+#define BUFFER_MMAP_WINDOW ((size_t) 1 << 30)
+#else
+#define BUFFER_MMAP_WINDOW ((size_t) 64 << 20)
+#endif
+
+// Prefetch window for sequential readers, doubled on every top-up until it reaches the maximum
+#define BUFFER_READAHEAD_MIN (128 << 10)
+#define BUFFER_READAHEAD_MAX (8 << 20)
+
+// Process-wide block cache shared by handles opened with the block_cache option: default memory budget,
+// size of the blocks it holds and number of independently locked shards
+#define BUFFER_CACHE_BUDGET ((size_t) 64 << 20)
+#define BUFFER_CACHE_BLOCK (16 << 10)
+#define BUFFER_CACHE_SHARDS 16
+
+// Durability policies for the durability option, deciding when flushed data is forced to stable storage
+#define BUFFER_DURABILITY_NONE 0        // Flushed data stays in the page cache until the kernel writes it back
+#define BUFFER_DURABILITY_FLUSH 1       // buffered_flush and buffered_close fdatasync whatever they handed to the kernel
+#define BUFFER_DURABILITY_GROUP 2       // Group commit: one fdatasync covers the flushes of sync_interval_ms or sync_bytes
+#define BUFFER_DURABILITY_WRITEBACK 3   // Flushed ranges are queued for writeback with sync_file_range, nothing waits
+
+// Group commit interval used when neither sync_interval_ms nor sync_bytes is set
+#define BUFFER_SYNC_INTERVAL_MS 10
+
+// Number of buckets in the flush latency histogram, bucket i counts flushes that took under 2^i microseconds
+#define BUFFER_LATENCY_BUCKETS 32
+
+// I/O statistics of a handle opened with the stats option, read with buffered_stats
+typedef struct {
+    uint64_t read_calls;            // buffered_read, buffered_readv, buffered_pread, buffered_peek and buffered_read_until calls
+    uint64_t read_calls_buffered;   // Read calls served without any syscall
+    uint64_t write_calls;           // buffered_write, buffered_writev and buffered_pwrite calls
+    uint64_t write_calls_buffered;  // Write calls that only copied into the buffers
+    uint64_t bytes_read;            // Bytes the caller asked to read, peeked data counts once consumed
+    uint64_t bytes_written;         // Bytes the caller asked to write
+    uint64_t kernel_bytes_read;     // Bytes read from files by syscalls, prepend rewrites included
+    uint64_t kernel_bytes_written;  // Bytes written to files by syscalls, prepend rewrites included
+    uint64_t read_syscalls;         // read, readv and pread calls
+    uint64_t write_syscalls;        // write, writev, pwrite and copy_file_range calls
+    uint64_t seek_syscalls;         // lseek calls
+    uint64_t flushes;               // Times buffered data was handed to the kernel
+    uint64_t prepend_bytes_moved;   // Existing file data O_PREAPPEND rewrote to make room for inserts
+    uint64_t syncs;                 // fdatasync calls made for the durability policy and buffered_sync
+    uint64_t cache_hits;            // Blocks served from the shared block cache
+    uint64_t cache_misses;          // Blocks read from the file into the shared block cache
+    uint64_t auto_flushes;          // Flushes made because buffered data reached flush_latency_us
+    uint64_t flush_latency[BUFFER_LATENCY_BUCKETS]; // Flushes by how long they took, see BUFFER_LATENCY_BUCKETS
+} buffered_stats_t;
+
+// Options for buffered_open_ex, a zeroed structure gives the same behaviour as buffered_open
+typedef struct {
+    size_t read_buffer_size;    // Capacity of the read buffer in bytes (0 picks the default)
+    size_t write_buffer_size;   // Capacity of the write buffer in bytes (0 picks the default)
+    int auto_size;              // Size buffers left at 0 from fstat().st_blksize and the file size instead of BUFFER_SIZE
+    int prepend_atomic;         // O_PREAPPEND builds the new file in anonymous scratch space and renames it over the original
+    int prepend_log;            // O_PREAPPEND appends to the sidecar log <path>.prefix instead of moving the file's data,
+                                // read-only handles see the log's data in front of the file (O_RDWR and plain
+                                // O_WRONLY without O_TRUNC are refused)
+    int write_behind_buffers;   // Number of write buffers, 2 or more hands full ones to a background flusher thread
+    int checksum;               // Keep a running CRC32C of the data written and read, see buffered_checksum
+    int stats;                  // Keep I/O statistics for buffered_stats, handles without them pay a single branch per call
+    int durability;             // One of the BUFFER_DURABILITY_* policies (0 leaves syncing to buffered_sync)
+    unsigned sync_interval_ms;  // Group commit: sync once this long has passed since the last sync (0 for no time limit)
+    size_t sync_bytes;          // Group commit: sync once this much was flushed since the last sync (0 for no size limit)
+    int block_cache;            // Read through the process-wide block cache, shared with every other handle on the file
+    unsigned flush_latency_us;  // Flush written data at the latest this long after it was buffered (0 for no bound)
+} buffered_open_options_t;
+
+// Background flusher state for write-behind handles, private to buffered_open.c
+struct buffered_writer;
+
+// Shared flush timer state for handles with flush_latency_us, private to buffered_open.c
+struct buffered_autoflush;
+
+// Pool that recycles handle memory between buffered_open_from_pool and buffered_close
+typedef struct buffered_pool buffered_pool_t;
+
 // Structure to hold the buffer and original flags
 typedef struct {
     int fd;                     // File descriptor for the opened file
 
-    char *read_buffer;          // Buffer for reading operations, holds data read from the file
-    char *write_buffer;         // Buffer for writing operations, holds data to be written to the file
+    char *read_buffer;          // Buffer for reading operations, holds data read from the file (NULL if never read)
+    char *write_buffer;         // Buffer for writing operations, holds data to be written to the file (NULL if never written)
 
-    size_t read_buffer_size;    // Size of the read buffer, indicating how much data it can hold
+    size_t read_buffer_size;    // Number of valid bytes currently held in the read buffer
+    size_t read_buffer_capacity; // Allocated size of the read buffer, the most a single refill can load
     size_t write_buffer_size;   // Size of the write buffer, indicating how much data it can hold
 
     size_t read_buffer_pos;     // Current position in the read buffer, indicating the next byte to be read
@@ -26,21 +132,160 @@ typedef struct {
     int flags;                  // File flags used to control file access modes and options (like O_RDONLY, O_WRONLY)
 
     int preappend;              // Flag to remember if the O_PREAPPEND flag was used, indicating special handling for writes
+
+    char *prepend_buffer;       // Data written in O_PREAPPEND mode, inserted into the file in one go on flush or close
+    size_t prepend_buffer_size; // Allocated size of the prepend buffer, grows as data is queued
+    size_t prepend_buffer_pos;  // Number of bytes queued in the prepend buffer
+    int prepend_atomic;         // Flag to remember that prepends are published with an atomic rename instead of in place
+    char *pathname;             // Path the file was opened with, kept only for atomic prepends
+    int prefix_log;             // Flag to remember that prepends are appended to the sidecar prefix log
+    int prefix_fd;              // The sidecar prefix log, open for appending while prefix_log is set
+    uint64_t prefix_generation; // Generation this handle's log records carry, newer generations come first
+    char *prefix_data;          // Read-only prepend_log handles on a file with a prefix log: the whole logical prefix
+    size_t prefix_length;       // Length of that prefix, base file offsets are shifted by this much
+
+    int mmap_mode;              // Flag to remember if reads are served from a mapping (O_MMAP on a read-only handle)
+    char *map_base;             // Start of the currently mapped window, NULL while nothing is mapped
+    off_t map_offset;           // File offset the mapped window starts at
+    size_t map_length;          // Length of the mapped window
+    off_t map_pos;              // File offset of the next byte buffered_read returns in mmap mode
+
+    struct buffered_writer *writer; // Background flusher in write-behind mode, NULL while writes are synchronous
+    struct buffered_autoflush *autoflush; // Registration with the flush timer, NULL without flush_latency_us
+
+    size_t direct_align;        // Block size O_DIRECT transfers are aligned to, 0 when going through the page cache
+
+    int coherent;               // O_RDWR (or block-cached) on a regular file: reads and writes share the read buffer as one window
+    size_t dirty_start;         // Start of the bytes in that window written but not yet in the file
+    size_t dirty_end;           // End of the written bytes, equal to dirty_start while the window is clean
+
+    buffered_stats_t *stats;    // Statistics kept when the stats option is set, NULL otherwise
+    int checksum;               // Set when the checksum option asked for a running CRC32C
+    uint32_t checksum_state;    // CRC32C register over the bytes passed through so far, before the final inversion
+
+    int durability;             // BUFFER_DURABILITY_* policy applied whenever data reaches the kernel
+    uint64_t sync_interval;     // Group commit time limit in nanoseconds, 0 for none
+    size_t sync_bytes;          // Group commit size limit in bytes, 0 for none
+    size_t sync_pending;        // Bytes handed to the kernel since the last fdatasync
+    uint64_t sync_last;         // Monotonic time of the last fdatasync, or of the open
+    int sync_error;             // errno of an fdatasync that failed after its write returned, owed to the next flush
+
+    int block_cache;            // Set when reads go through the shared block cache (read-only and coherent handles)
+    dev_t cache_dev;            // Device of the file, for finding its cached blocks and dropping them on writes
+    ino_t cache_ino;            // Inode of the file, 0 when unknown (the handle then leaves the cache alone)
+
+    buffered_pool_t *pool;      // Pool the handle's memory goes back to on close, NULL for standalone handles
+    int read_buffer_heap;       // Set once buffered_peek has moved the read buffer out of the handle's block
+
+    int read_regular;           // Whether reads come from a regular file (-1 until the first read checks)
+    off_t read_file_size;       // File size seen by that check, no prefetching is done past it
+    off_t file_offset;          // Offset of the fd as tracked by the handle, -1 after O_APPEND writes until it is asked for
+    off_t readahead_next;       // Offset a sequential reader would read next
+    off_t readahead_end;        // End of the range already prefetched with POSIX_FADV_WILLNEED, -1 after random access
+    size_t readahead_window;    // Size of the next prefetch, 0 while access looks random
 } buffered_file_t;
 
 // Function to wrap the original open function
 buffered_file_t *buffered_open(const char *pathname, int flags, ...);
 
+// Function to open a buffered file with explicit buffer options (opts may be NULL)
+buffered_file_t *buffered_open_ex(const char *pathname, int flags, mode_t mode, const buffered_open_options_t *opts);
+
+// Function to create a pool that keeps up to max_handles closed handles (with their buffers) for reuse.
+// Buffer sizes come from opts and are fixed for the pool, auto_size is ignored
+buffered_pool_t *buffered_pool_create(size_t max_handles, const buffered_open_options_t *opts);
+
+// Function to open a buffered file with memory taken from the pool, buffered_close returns it
+buffered_file_t *buffered_open_from_pool(buffered_pool_t *pool, const char *pathname, int flags, mode_t mode);
+
+// Function to destroy a pool, handles still open from it keep working and free it when the last one closes
+void buffered_pool_destroy(buffered_pool_t *pool);
+
+// Function to get the CRC32C of every byte passed through buffered_write, buffered_writev, buffered_printf,
+// buffered_read, buffered_readv and buffered_consume (so buffered_read_until too) since the handle was opened
+// with the checksum option, in call order. Positional I/O is not included. Returns 0 without the option
+uint32_t buffered_checksum(buffered_file_t *bf);
+
+// Function to copy up to len bytes from src's position to dst's position, moving both. Data src has
+// already buffered is drained first, the rest is moved by the kernel (copy_file_range, sendfile or splice)
+// without passing through user space. Returns the bytes copied, fewer than len at end of input, or -1.
+// The copied bytes are not part of either handle's checksum
+ssize_t buffered_copy(buffered_file_t *dst, buffered_file_t *src, size_t len);
+
+// Function to set the memory budget of the process-wide block cache in bytes (0 picks BUFFER_CACHE_BUDGET).
+// It has to come before the first handle that uses the cache, which otherwise starts it with the default
+// budget; later calls fail with EBUSY
+int buffered_cache_configure(size_t budget);
+
+// Function to copy the handle's statistics into out. Fails with EINVAL when the handle was opened without
+// the stats option. Counters are updated with relaxed atomics, so a snapshot taken while a write-behind
+// flusher runs may be slightly behind
+int buffered_stats(buffered_file_t *bf, buffered_stats_t *out);
+
 // Function to write to the buffered file
 ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count);
 
+// Functions to write formatted output like printf, straight into the free space of the write buffer.
+// Returns the number of bytes written or -1
+int buffered_printf(buffered_file_t *bf, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+int buffered_vprintf(buffered_file_t *bf, const char *fmt, va_list ap);
+
 // Function to read from the buffered file
 ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count);
 
-// Function to flush the buffer to the file
+// Functions to write and read several pieces in one call, like writev/readv. Small pieces are packed
+// through the buffers, large ones go to the kernel in a single writev/readv together with the buffered data
+ssize_t buffered_writev(buffered_file_t *bf, const struct iovec *iov, int iovcnt);
+ssize_t buffered_readv(buffered_file_t *bf, const struct iovec *iov, int iovcnt);
+
+// Function to look at the next bytes of the file without copying them. On entry *len is the number of
+// contiguous bytes wanted (0 for whatever is buffered), on return *ptr points into the read buffer and
+// *len holds how many bytes are there, fewer than wanted only at end of file. The view stays valid
+// until the next call on the handle
+int buffered_peek(buffered_file_t *bf, const char **ptr, size_t *len);
+
+// Function to mark n bytes of the last peeked view as read
+int buffered_consume(buffered_file_t *bf, size_t n);
+
+// Function to read up to and including the next delim, at most count bytes. Returns the number of bytes
+// stored in buf (not NUL terminated), 0 at end of file and -1 on error. A record longer than count is
+// returned in pieces, only the last of which ends in delim
+ssize_t buffered_read_until(buffered_file_t *bf, int delim, void *buf, size_t count);
+
+// Function to read the next line including its '\n', see buffered_read_until
+ssize_t buffered_readline(buffered_file_t *bf, void *buf, size_t count);
+
+// Function to reposition the buffered file. Seeks that land inside the read buffer reuse it without a
+// syscall, pending writes are flushed only when the position actually moves
+off_t buffered_lseek(buffered_file_t *bf, off_t offset, int whence);
+
+// Functions to read and write at an explicit offset without moving the handle's position. Buffered data
+// overlapping the range is taken into account, so several threads can share a handle for positional I/O
+// as long as none of them uses the streaming calls at the same time
+ssize_t buffered_pread(buffered_file_t *bf, void *buf, size_t count, off_t offset);
+ssize_t buffered_pwrite(buffered_file_t *bf, const void *buf, size_t count, off_t offset);
+
+// Function to merge the sidecar prefix log of pathname into the file itself. The merged file is built
+// aside and renamed over the original, so a crash leaves either the old pair or the merged file.
+// Returns 0 when there was nothing to merge
+int buffered_compact(const char *pathname);
+
+// Function to flush the buffer to the file. With BUFFER_DURABILITY_FLUSH it also waits for the data to
+// reach stable storage
 int buffered_flush(buffered_file_t *bf);
 
+// Function to flush the buffer and fdatasync the file whatever the durability policy, for commit points
+int buffered_sync(buffered_file_t *bf);
+
 // Function to close the buffered file
 int buffered_close(buffered_file_t *bf);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // BUFFERED_OPEN_H
@@ -0,0 +1,1028 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Behaviour checks for buffered_open, one function per mode. Every check runs in a scratch directory
+// created under the current directory, so O_DIRECT is tried on a real filesystem when ctest runs from
+// the build tree. Usage: test_buffered [test ...], all tests by default
+
+// Fail the current test with the condition that did not hold
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+static char scratch[64];
+
+// Path of name inside the scratch directory, valid until the next call
+static const char *scratch_path(const char *name) {
+    static char path[2][128];
+    static int next;
+    next = !next;
+    snprintf(path[next], sizeof(path[next]), "%s/%s", scratch, name);
+    return path[next];
+}
+
+static int write_file(const char *path, const void *data, size_t length) {
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return -1;
+    size_t written = fwrite(data, 1, length, file);
+    return fclose(file) == 0 && written == length ? 0 : -1;
+}
+
+// Read a whole file with plain stdio into buf, returning its length or -1
+static ssize_t read_file(const char *path, char *buf, size_t size) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    size_t length = fread(buf, 1, size, file);
+    fclose(file);
+    return (ssize_t) length;
+}
+
+// Read the whole logical file through a buffered handle opened with opts
+static ssize_t read_handle(const char *path, const buffered_open_options_t *opts, char *buf, size_t size) {
+    buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, opts);
+    if (!bf)
+        return -1;
+    size_t length = 0;
+    ssize_t read_bytes;
+    while (length < size && (read_bytes = buffered_read(bf, buf + length, 7)) > 0)
+        length += (size_t) read_bytes;
+    buffered_close(bf);
+    return (ssize_t) length;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == -1 ? -1 : st.st_size;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static int test_auto_size(void) {
+    const char *path = scratch_path("auto_size");
+    static char data[10000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) ('0' + i % 10);
+    CHECK(write_file(path, data, sizeof(data)) == 0);
+    struct stat st;
+    CHECK(stat(path, &st) == 0);
+    size_t block = st.st_blksize > 0 ? (size_t) st.st_blksize : BUFFER_SIZE;
+    size_t limit = block > BUFFER_AUTO_MAX ? block : BUFFER_AUTO_MAX;
+    size_t whole_file = (sizeof(data) + block - 1) / block * block;
+
+    // Reads take a small file in one piece, writes start at a batch of blocks
+    buffered_open_options_t opts = {0};
+    opts.auto_size = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    CHECK(bf);
+    CHECK(bf->read_buffer_capacity == (whole_file < limit ? whole_file : limit));
+    static char buf[sizeof(data)];
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == (ssize_t) sizeof(data) && memcmp(buf, data, sizeof(data)) == 0);
+    CHECK(buffered_close(bf) == 0);
+
+    size_t batch = block * BUFFER_AUTO_BLOCKS > whole_file ? block * BUFFER_AUTO_BLOCKS : whole_file;
+    bf = buffered_open_ex(path, O_WRONLY | O_APPEND, 0, &opts);
+    CHECK(bf);
+    CHECK(bf->write_buffer_size == (batch < limit ? batch : limit));
+    CHECK(buffered_close(bf) == 0);
+
+    // Sizes given explicitly are kept, only the ones left at 0 are picked
+    opts.read_buffer_size = 100;
+    opts.write_buffer_size = 10;
+    bf = buffered_open_ex(path, O_WRONLY | O_TRUNC, 0, &opts);
+    CHECK(bf);
+    CHECK(bf->write_buffer_size == 10);
+    CHECK(buffered_write(bf, data, 25) == 25);
+    CHECK(buffered_close(bf) == 0);
+    CHECK(read_handle(path, &opts, buf, sizeof(buf)) == 25 && memcmp(buf, data, 25) == 0);
+    return 0;
+}
+
+static int test_prepend_in_place(void) {
+    const char *path = scratch_path("prepend");
+    CHECK(write_file(path, "tail\n", 5) == 0);
+
+    buffered_file_t *bf = buffered_open(path, O_RDWR | O_PREAPPEND);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "one ", 4) == 4);
+    CHECK(buffered_flush(bf) == 0);
+    CHECK(buffered_write(bf, "two ", 4) == 4);
+    CHECK(buffered_close(bf) == 0);
+
+    char buf[64];
+    CHECK(read_file(path, buf, sizeof(buf)) == 13);
+    CHECK(memcmp(buf, "one two tail\n", 13) == 0);
+    return 0;
+}
+
+static int test_prepend_atomic(void) {
+    const char *path = scratch_path("atomic");
+    CHECK(write_file(path, "tail\n", 5) == 0);
+
+    buffered_open_options_t opts = {0};
+    opts.prepend_atomic = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_RDWR | O_PREAPPEND, 0, &opts);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "head ", 5) == 5);
+    CHECK(buffered_close(bf) == 0);
+
+    char buf[64];
+    CHECK(read_file(path, buf, sizeof(buf)) == 10);
+    CHECK(memcmp(buf, "head tail\n", 10) == 0);
+    return 0;
+}
+
+static int test_mmap(void) {
+    const char *path = scratch_path("mmap");
+    char data[1500];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) ('a' + i % 26);
+    CHECK(write_file(path, data, 1000) == 0);
+
+    buffered_file_t *bf = buffered_open(path, O_RDONLY | O_MMAP);
+    CHECK(bf && bf->mmap_mode);
+    char buf[sizeof(data)];
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == 1000 && memcmp(buf, data, 1000) == 0);
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == 0);
+
+    // A file that grew while open is mapped again past the old end
+    buffered_file_t *writer = buffered_open(path, O_WRONLY | O_APPEND);
+    CHECK(writer);
+    CHECK(buffered_write(writer, data + 1000, 500) == 500);
+    CHECK(buffered_close(writer) == 0);
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == 500 && memcmp(buf, data + 1000, 500) == 0);
+
+    // One that shrank below the position reads as ended, without touching the old mapping
+    CHECK(truncate(path, 200) == 0);
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == 0);
+    CHECK(buffered_close(bf) == 0);
+
+    // The flag only applies to read-only handles
+    bf = buffered_open(path, O_RDWR | O_MMAP);
+    CHECK(bf && !bf->mmap_mode);
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == 200 && memcmp(buf, data, 200) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_write_behind(void) {
+    const char *path = scratch_path("behind");
+    buffered_open_options_t opts = {0};
+    opts.write_behind_buffers = 3;
+    opts.write_buffer_size = 4096;
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+
+    char record[1000];
+    for (int i = 0; i < 1049; i++) {
+        memset(record, 'a' + i % 26, sizeof(record));
+        CHECK(buffered_write(bf, record, sizeof(record)) == (ssize_t) sizeof(record));
+    }
+    CHECK(buffered_flush(bf) == 0);
+    CHECK(file_size(path) == 1049000);
+    CHECK(buffered_close(bf) == 0);
+
+    // The flusher keeps the buffers in order
+    bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    for (int i = 0; i < 1049; i++) {
+        CHECK(buffered_read(bf, record, sizeof(record)) == (ssize_t) sizeof(record));
+        CHECK(record[0] == 'a' + i % 26 && record[sizeof(record) - 1] == 'a' + i % 26);
+    }
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_readahead(void) {
+    const char *path = scratch_path("readahead");
+    static char data[1 << 20];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 13 + i / 4096);
+    CHECK(write_file(path, data, sizeof(data)) == 0);
+
+    // Sequential reads keep a prefetched range ahead of the reader, its window doubling on every top-up
+    buffered_file_t *bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    char buf[4096];
+    size_t total = 0;
+    for (int i = 0; i < 64; i++) {
+        CHECK(buffered_read(bf, buf, sizeof(buf)) == (ssize_t) sizeof(buf));
+        CHECK(memcmp(buf, data + total, sizeof(buf)) == 0);
+        total += sizeof(buf);
+    }
+    CHECK(bf->readahead_window > BUFFER_READAHEAD_MIN && bf->readahead_window <= BUFFER_READAHEAD_MAX);
+    CHECK(bf->readahead_end > (off_t) total);
+
+    // The rest of the file still reads back in order, and nothing is prefetched past its end
+    ssize_t read_bytes;
+    while ((read_bytes = buffered_read(bf, buf, sizeof(buf))) > 0) {
+        CHECK(memcmp(buf, data + total, (size_t) read_bytes) == 0);
+        total += (size_t) read_bytes;
+    }
+    CHECK(read_bytes == 0 && total == sizeof(data));
+    CHECK(bf->readahead_end <= (off_t) sizeof(data) + (off_t) bf->readahead_window);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_peek(void) {
+    const char *path = scratch_path("peek");
+    static char data[10000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 5 + i / 100);
+    CHECK(write_file(path, data, sizeof(data)) == 0);
+
+    // The same sequence through the read buffer and through a mapping
+    buffered_open_options_t opts = {0};
+    opts.read_buffer_size = 64;
+    for (int mapped = 0; mapped < 2; mapped++) {
+        buffered_file_t *bf = buffered_open_ex(path, O_RDONLY | (mapped ? O_MMAP : 0), 0, &opts);
+        CHECK(bf);
+        const char *view;
+        size_t len = 10;
+        CHECK(buffered_peek(bf, &view, &len) == 0 && len >= 10 && memcmp(view, data, 10) == 0);
+        CHECK(buffered_consume(bf, 4) == 0);
+
+        // A view larger than the read buffer makes it grow, and only what a view shows can be consumed
+        len = 1000;
+        CHECK(buffered_peek(bf, &view, &len) == 0 && len >= 1000 && memcmp(view, data + 4, 1000) == 0);
+        CHECK(buffered_consume(bf, len + 1) == -1 && errno == EINVAL);
+        CHECK(buffered_consume(bf, 1000) == 0);
+
+        static char buf[sizeof(data)];
+        CHECK(buffered_read(bf, buf, sizeof(buf)) == (ssize_t) sizeof(data) - 1004);
+        CHECK(memcmp(buf, data + 1004, sizeof(data) - 1004) == 0);
+
+        // At end of file the view is empty and there is nothing to consume
+        len = 0;
+        CHECK(buffered_peek(bf, &view, &len) == 0 && len == 0);
+        CHECK(buffered_consume(bf, 1) == -1 && errno == EINVAL);
+        CHECK(buffered_close(bf) == 0);
+    }
+
+    buffered_file_t *bf = buffered_open(path, O_WRONLY);
+    CHECK(bf);
+    const char *view;
+    size_t len = 0;
+    CHECK(buffered_peek(bf, &view, &len) == -1 && errno == EBADF);
+    CHECK(buffered_consume(bf, 1) == -1 && errno == EINVAL);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_readline(void) {
+    const char *path = scratch_path("readline");
+
+    // Lines of every length from 0 to 99, so their ends fall at every offset within 16 and 32 byte blocks
+    // and on both sides of the small read buffer's refills, then a last line without its '\n'
+    static char data[6000];
+    size_t length = 0;
+    for (int line = 0; line < 100; line++) {
+        for (int i = 0; i < line; i++)
+            data[length++] = (char) ('a' + (line + i) % 26);
+        data[length++] = '\n';
+    }
+    memcpy(data + length, "tail", 4);
+    length += 4;
+    CHECK(write_file(path, data, length) == 0);
+
+    static const size_t read_buffer_sizes[] = {64, 0};
+    for (size_t size = 0; size < sizeof(read_buffer_sizes) / sizeof(read_buffer_sizes[0]); size++) {
+        buffered_open_options_t opts = {0};
+        opts.read_buffer_size = read_buffer_sizes[size];
+        buffered_file_t *bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+        CHECK(bf);
+        char line[128];
+        size_t offset = 0;
+        for (int expected = 0; expected < 100; expected++) {
+            CHECK(buffered_readline(bf, line, sizeof(line)) == expected + 1);
+            CHECK(memcmp(line, data + offset, (size_t) expected + 1) == 0);
+            offset += (size_t) expected + 1;
+        }
+        CHECK(buffered_readline(bf, line, sizeof(line)) == 4 && memcmp(line, "tail", 4) == 0);
+        CHECK(buffered_readline(bf, line, sizeof(line)) == 0);
+        CHECK(buffered_close(bf) == 0);
+    }
+
+    // Records longer than count come back in pieces, only the last one ending in the delimiter
+    CHECK(write_file(path, "0123456789abcdefghij;x;", 23) == 0);
+    buffered_file_t *bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    char piece[8];
+    CHECK(buffered_read_until(bf, ';', piece, sizeof(piece)) == 8 && memcmp(piece, "01234567", 8) == 0);
+    CHECK(buffered_read_until(bf, ';', piece, sizeof(piece)) == 8 && memcmp(piece, "89abcdef", 8) == 0);
+    CHECK(buffered_read_until(bf, ';', piece, sizeof(piece)) == 5 && memcmp(piece, "ghij;", 5) == 0);
+    CHECK(buffered_read_until(bf, ';', piece, sizeof(piece)) == 2 && memcmp(piece, "x;", 2) == 0);
+    CHECK(buffered_read_until(bf, ';', piece, sizeof(piece)) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_positional(void) {
+    const char *path = scratch_path("positional");
+    buffered_file_t *bf = buffered_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(bf);
+
+    // Buffered data under a positional write goes out first, so the positional write lands on top of it
+    CHECK(buffered_write(bf, "aaaaaaaaaa", 10) == 10);
+    CHECK(buffered_pwrite(bf, "BB", 2, 2) == 2);
+    CHECK(buffered_write(bf, "cc", 2) == 2);
+    CHECK(buffered_close(bf) == 0);
+    char buf[16];
+    CHECK(read_file(path, buf, sizeof(buf)) == 12 && memcmp(buf, "aaBBaaaaaacc", 12) == 0);
+
+    // Positional reads leave the position alone, seeks inside the read buffer keep what it holds
+    bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    CHECK(buffered_read(bf, buf, 3) == 3 && memcmp(buf, "aaB", 3) == 0);
+    CHECK(buffered_pread(bf, buf, 4, 8) == 4 && memcmp(buf, "aacc", 4) == 0);
+    CHECK(buffered_lseek(bf, 0, SEEK_CUR) == 3);
+    CHECK(buffered_lseek(bf, -2, SEEK_CUR) == 1);
+    CHECK(buffered_read(bf, buf, 4) == 4 && memcmp(buf, "aBBa", 4) == 0);
+    CHECK(buffered_lseek(bf, 0, SEEK_END) == 12);
+    CHECK(buffered_read(bf, buf, 4) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_pool(void) {
+    const char *first_path = scratch_path("pool_first");
+    const char *second_path = scratch_path("pool_second");
+    CHECK(write_file(second_path, "second\n", 7) == 0);
+
+    buffered_open_options_t opts = {0};
+    opts.read_buffer_size = 128;
+    opts.write_buffer_size = 128;
+    buffered_pool_t *pool = buffered_pool_create(1, &opts);
+    CHECK(pool);
+
+    // Handles closed with data written or read ahead leave nothing behind for the next file
+    buffered_file_t *bf = buffered_open_from_pool(pool, first_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "first\n", 6) == 6);
+    CHECK(buffered_close(bf) == 0);
+    buffered_file_t *reused = buffered_open_from_pool(pool, first_path, O_RDONLY, 0);
+    CHECK(reused == bf);
+    char buf[16];
+    CHECK(buffered_read(reused, buf, 3) == 3 && memcmp(buf, "fir", 3) == 0);
+    CHECK(buffered_close(reused) == 0);
+
+    reused = buffered_open_from_pool(pool, second_path, O_RDONLY, 0);
+    CHECK(reused == bf);
+    CHECK(reused->read_buffer_size == 0 && reused->read_buffer_pos == 0 && reused->write_buffer_pos == 0);
+    CHECK(reused->read_buffer_capacity == 128 && reused->write_buffer_size == 128);
+
+    // A second handle open at the same time gets memory of its own
+    buffered_file_t *other = buffered_open_from_pool(pool, first_path, O_RDONLY, 0);
+    CHECK(other && other != reused);
+    CHECK(buffered_read(other, buf, sizeof(buf)) == 6 && memcmp(buf, "first\n", 6) == 0);
+    CHECK(buffered_close(other) == 0);
+
+    // Handles still open outlive the pool
+    buffered_pool_destroy(pool);
+    CHECK(buffered_read(reused, buf, sizeof(buf)) == 7 && memcmp(buf, "second\n", 7) == 0);
+    CHECK(buffered_close(reused) == 0);
+    return 0;
+}
+
+static int test_direct(void) {
+    const char *path = scratch_path("direct");
+    char data[10000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) ('a' + i % 26);
+
+    buffered_file_t *bf = buffered_open(path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    CHECK(bf);
+    CHECK(buffered_write(bf, data, sizeof(data)) == (ssize_t) sizeof(data));
+    CHECK(buffered_lseek(bf, 4095, SEEK_SET) == 4095);
+    char buf[10000];
+    CHECK(buffered_read(bf, buf, 3) == 3 && memcmp(buf, data + 4095, 3) == 0);
+    CHECK(buffered_close(bf) == 0);
+    CHECK(read_file(path, buf, sizeof(buf)) == (ssize_t) sizeof(data) && memcmp(buf, data, sizeof(data)) == 0);
+
+    // Write-only with a length that is not a multiple of the block size, the partial block is read back
+    bf = buffered_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "hello\n", 6) == 6);
+    CHECK(buffered_read(bf, buf, 4) == -1);
+    CHECK(buffered_pwrite(bf, "J", 1, 0) == 1);
+    CHECK(buffered_close(bf) == 0);
+    CHECK(read_file(path, buf, sizeof(buf)) == 6 && memcmp(buf, "Jello\n", 6) == 0);
+    return 0;
+}
+
+static int test_coherent(void) {
+    const char *path = scratch_path("coherent");
+    buffered_file_t *bf = buffered_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "hello world\n", 12) == 12);
+    CHECK(buffered_lseek(bf, 6, SEEK_SET) == 6);
+
+    char buf[16];
+    CHECK(buffered_read(bf, buf, 5) == 5 && memcmp(buf, "world", 5) == 0);
+    CHECK(buffered_lseek(bf, 0, SEEK_SET) == 0);
+    CHECK(buffered_write(bf, "J", 1) == 1);
+    CHECK(buffered_read(bf, buf, 4) == 4 && memcmp(buf, "ello", 4) == 0);
+    CHECK(buffered_pwrite(bf, "W", 1, 6) == 1);
+    CHECK(buffered_pread(bf, buf, 5, 6) == 5 && memcmp(buf, "World", 5) == 0);
+    CHECK(buffered_close(bf) == 0);
+
+    CHECK(read_file(path, buf, sizeof(buf)) == 12 && memcmp(buf, "Jello World\n", 12) == 0);
+    return 0;
+}
+
+#define POSITIONAL_THREADS 4
+#define POSITIONAL_RECORDS 200
+
+struct positional_worker {
+    buffered_file_t *bf;
+    int id;
+    int failed;
+};
+
+// Write this worker's records, interleaved with the other workers', and read each one back
+static void *positional_worker_run(void *arg) {
+    struct positional_worker *worker = arg;
+    char record[64], back[64];
+    for (int i = 0; i < POSITIONAL_RECORDS && !worker->failed; i++) {
+        off_t offset = 4096 + ((off_t) i * POSITIONAL_THREADS + worker->id) * (off_t) sizeof(record);
+        memset(record, 'a' + worker->id, sizeof(record));
+        snprintf(record, sizeof(record), "%d:%d", worker->id, i);
+        worker->failed = buffered_pwrite(worker->bf, record, sizeof(record), offset) != (ssize_t) sizeof(record) ||
+                         buffered_pread(worker->bf, back, sizeof(back), offset) != (ssize_t) sizeof(back) ||
+                         memcmp(record, back, sizeof(record)) != 0;
+    }
+    return NULL;
+}
+
+static int test_coherent_threads(void) {
+    const char *path = scratch_path("coherent_threads");
+    buffered_file_t *bf = buffered_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(bf);
+
+    // Written bytes still in the window go out before a positional write over them, which the window
+    // then reflects
+    char buf[16];
+    CHECK(buffered_write(bf, "0123456789", 10) == 10);
+    CHECK(buffered_pwrite(bf, "ab", 2, 4) == 2);
+    CHECK(buffered_pread(bf, buf, 10, 0) == 10 && memcmp(buf, "0123ab6789", 10) == 0);
+    CHECK(buffered_write(bf, "X", 1) == 1);
+    CHECK(buffered_lseek(bf, 0, SEEK_SET) == 0);
+    CHECK(buffered_read(bf, buf, 11) == 11 && memcmp(buf, "0123ab6789X", 11) == 0);
+    CHECK(buffered_flush(bf) == 0);
+
+    // Threads sharing the handle for positional I/O only
+    pthread_t threads[POSITIONAL_THREADS];
+    struct positional_worker workers[POSITIONAL_THREADS];
+    for (int i = 0; i < POSITIONAL_THREADS; i++) {
+        workers[i] = (struct positional_worker) {bf, i, 0};
+        CHECK(pthread_create(&threads[i], NULL, positional_worker_run, &workers[i]) == 0);
+    }
+    for (int i = 0; i < POSITIONAL_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < POSITIONAL_THREADS; i++)
+        CHECK(!workers[i].failed);
+    CHECK(buffered_close(bf) == 0);
+
+    static char data[4096 + POSITIONAL_THREADS * POSITIONAL_RECORDS * 64];
+    CHECK(read_file(path, data, sizeof(data)) == (ssize_t) sizeof(data));
+    CHECK(memcmp(data, "0123ab6789X", 11) == 0);
+    for (int record = 0; record < POSITIONAL_THREADS * POSITIONAL_RECORDS; record++) {
+        char expected[64];
+        memset(expected, 'a' + record % POSITIONAL_THREADS, sizeof(expected));
+        snprintf(expected, sizeof(expected), "%d:%d", record % POSITIONAL_THREADS, record / POSITIONAL_THREADS);
+        CHECK(memcmp(data + 4096 + record * 64, expected, sizeof(expected)) == 0);
+    }
+    return 0;
+}
+
+static int test_vectored(void) {
+    const char *path = scratch_path("vectored");
+    buffered_open_options_t opts = {0};
+    opts.read_buffer_size = 64;
+    opts.write_buffer_size = 64;
+    char large[200];
+    for (size_t i = 0; i < sizeof(large); i++)
+        large[i] = (char) ('A' + i % 26);
+
+    // Small pieces, empty entries and a piece larger than the buffer all land in order
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+    struct iovec out[] = {
+        {(void *) "head", 4}, {NULL, 0}, {large, sizeof(large)}, {(void *) "", 0}, {(void *) "tail", 4},
+    };
+    CHECK(buffered_writev(bf, out, 5) == 208);
+    CHECK(buffered_writev(bf, out + 1, 1) == 0);
+    CHECK(buffered_close(bf) == 0);
+
+    char expected[208];
+    memcpy(expected, "head", 4);
+    memcpy(expected + 4, large, sizeof(large));
+    memcpy(expected + 204, "tail", 4);
+    char buf[300];
+    CHECK(read_file(path, buf, sizeof(buf)) == 208 && memcmp(buf, expected, 208) == 0);
+
+    // A read running into the end of the file fills what it can, in order
+    bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    CHECK(bf);
+    char first[3];
+    struct iovec in[] = {{first, sizeof(first)}, {NULL, 0}, {buf, sizeof(buf)}};
+    CHECK(buffered_readv(bf, in, 3) == 208);
+    CHECK(memcmp(first, expected, 3) == 0 && memcmp(buf, expected + 3, 205) == 0);
+    CHECK(buffered_readv(bf, in, 3) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_stats(void) {
+    const char *path = scratch_path("stats");
+    buffered_open_options_t opts = {0};
+    opts.stats = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+
+    // Small writes only copy, the flush hands them to the kernel in one syscall
+    for (int i = 0; i < 3; i++)
+        CHECK(buffered_write(bf, "abcd", 4) == 4);
+    CHECK(buffered_flush(bf) == 0);
+    buffered_stats_t stats;
+    CHECK(buffered_stats(bf, &stats) == 0);
+    CHECK(stats.write_calls == 3 && stats.write_calls_buffered == 3);
+    CHECK(stats.bytes_written == 12 && stats.kernel_bytes_written == 12);
+    CHECK(stats.write_syscalls == 1 && stats.flushes == 1);
+    uint64_t timed = 0;
+    for (int i = 0; i < BUFFER_LATENCY_BUCKETS; i++)
+        timed += stats.flush_latency[i];
+    CHECK(timed == stats.flushes);
+    CHECK(buffered_close(bf) == 0);
+
+    // Write-behind flushes are counted by the flusher thread
+    opts.write_behind_buffers = 3;
+    opts.write_buffer_size = 4096;
+    bf = buffered_open_ex(path, O_WRONLY | O_TRUNC, 0, &opts);
+    CHECK(bf);
+    char record[1000];
+    memset(record, 'w', sizeof(record));
+    for (int i = 0; i < 1049; i++)
+        CHECK(buffered_write(bf, record, sizeof(record)) == (ssize_t) sizeof(record));
+    CHECK(buffered_flush(bf) == 0);
+    CHECK(buffered_stats(bf, &stats) == 0);
+    CHECK(stats.bytes_written == 1049000);
+    CHECK(stats.kernel_bytes_written == 1049000);
+    CHECK(stats.flushes >= 1049000 / 4096);
+    CHECK(buffered_close(bf) == 0);
+
+    // Handles opened without the option have nothing to report
+    bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    CHECK(buffered_stats(bf, &stats) == -1 && errno == EINVAL);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+// One printf case: a format and the single argument it converts
+struct printf_case {
+    const char *format;
+    char type;                  // 'i' int, 'l' long, 'L' long long, 'z' size_t, 'u' unsigned, 'f' double, 's' string, 0 none
+    long long integer;
+    double real;
+    const char *text;
+};
+
+static const struct printf_case printf_cases[] = {
+    // Conversions, flags and widths the fast path handles
+    {"%d|", 'i', 0, 0, NULL},
+    {"%d|", 'i', -42, 0, NULL},
+    {"%i|", 'i', INT_MAX, 0, NULL},
+    {"%d|", 'i', INT_MIN, 0, NULL},
+    {"%7d|", 'i', -42, 0, NULL},
+    {"%-7d|", 'i', 42, 0, NULL},
+    {"%07d|", 'i', -42, 0, NULL},
+    {"%-07d|", 'i', 42, 0, NULL},
+    {"%2d|", 'i', 12345, 0, NULL},
+    {"%ld|", 'l', LONG_MIN, 0, NULL},
+    {"%lld|", 'L', LLONG_MAX, 0, NULL},
+    {"%zu|", 'z', LLONG_MAX, 0, NULL},
+    {"%u|", 'u', UINT_MAX, 0, NULL},
+    {"%x|", 'u', 0xbeef, 0, NULL},
+    {"%X|", 'u', 0xbeef, 0, NULL},
+    {"%08x|", 'u', 0xbeef, 0, NULL},
+    {"%lx|", 'l', LONG_MAX, 0, NULL},
+    {"%llX|", 'L', LLONG_MAX, 0, NULL},
+    {"%c|", 'i', 'q', 0, NULL},
+    {"%3c|", 'i', 'q', 0, NULL},
+    {"%-3c|", 'i', 'q', 0, NULL},
+    {"%s|", 's', 0, 0, "text"},
+    {"%8s|", 's', 0, 0, "text"},
+    {"%-8s|", 's', 0, 0, "text"},
+    {"%.2s|", 's', 0, 0, "text"},
+    {"%6.2s|", 's', 0, 0, "text"},
+    {"%s|", 's', 0, 0, ""},
+    {"100%%|", 0, 0, 0, NULL},
+    {"%f|", 'f', 0, 3.14159, NULL},
+    {"%f|", 'f', 0, -0.0, NULL},
+    {"%.0f|", 'f', 0, 2.4, NULL},
+    {"%.3f|", 'f', 0, -1234.5678, NULL},
+    {"%.9f|", 'f', 0, 0.123456789, NULL},
+    {"%12.3f|", 'f', 0, -1.5, NULL},
+    {"%-12.1f|", 'f', 0, 1.25, NULL},
+    {"%012.2f|", 'f', 0, -3.75, NULL},
+    {"%lf|", 'f', 0, 1e6, NULL},
+    // Cases the fast path hands to vsnprintf
+    {"%.2f|", 'f', 0, 2.675, NULL},
+    {"%.0f|", 'f', 0, 0.5, NULL},
+    {"%.12f|", 'f', 0, 1.0 / 3.0, NULL},
+    {"%f|", 'f', 0, 1e300, NULL},
+    {"%f|", 'f', 0, INFINITY, NULL},
+    {"%f|", 'f', 0, NAN, NULL},
+    {"%e|", 'f', 0, 12345.678, NULL},
+    {"%g|", 'f', 0, 0.0001, NULL},
+    {"%+d|", 'i', 42, 0, NULL},
+    {"% d|", 'i', 42, 0, NULL},
+    {"%#x|", 'u', 0xbeef, 0, NULL},
+    {"%.5d|", 'i', 42, 0, NULL},
+    {"%.3u|", 'u', 7, 0, NULL},
+    {"%hd|", 'i', 70000, 0, NULL},
+};
+
+// Print through the handle and append the same output from vsnprintf to expected. Fails when the
+// two disagree on the length
+__attribute__((format(printf, 4, 5)))
+static int printf_both(buffered_file_t *bf, char *expected, size_t *length, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int printed = buffered_vprintf(bf, format, ap);
+    va_end(ap);
+    va_start(ap, format);
+    int reference = vsnprintf(expected + *length, 4096, format, ap);
+    va_end(ap);
+    *length += (size_t) reference;
+    return printed == reference ? 0 : -1;
+}
+
+static int test_printf(void) {
+    const char *path = scratch_path("printf");
+    static char expected[1 << 16];
+    size_t length = 0;
+
+    // A small buffer, so records also land at its very end and go through the flush and retry
+    buffered_open_options_t opts = {0};
+    opts.write_buffer_size = 64;
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+    for (size_t i = 0; i < sizeof(printf_cases) / sizeof(printf_cases[0]); i++) {
+        const struct printf_case *c = &printf_cases[i];
+        int result;
+        if (c->type == 'i')
+            result = printf_both(bf, expected, &length, c->format, (int) c->integer);
+        else if (c->type == 'l')
+            result = printf_both(bf, expected, &length, c->format, (long) c->integer);
+        else if (c->type == 'L')
+            result = printf_both(bf, expected, &length, c->format, c->integer);
+        else if (c->type == 'z')
+            result = printf_both(bf, expected, &length, c->format, (size_t) c->integer);
+        else if (c->type == 'u')
+            result = printf_both(bf, expected, &length, c->format, (unsigned) c->integer);
+        else if (c->type == 'f')
+            result = printf_both(bf, expected, &length, c->format, c->real);
+        else if (c->type == 's')
+            result = printf_both(bf, expected, &length, c->format, c->text);
+        else
+            result = printf_both(bf, expected, &length, c->format);
+        if (result != 0)
+            fprintf(stderr, "printf case \"%s\" returned the wrong length\n", c->format);
+        CHECK(result == 0);
+    }
+
+    // Several conversions in one record, one of which the fast path does not handle
+    CHECK(printf_both(bf, expected, &length, "id=%d name=%-6s load=%5.1f%% mask=%#06x\n", 7, "disk", 99.25, 0x1f) == 0);
+
+    // %n is left to vsnprintf, which stores the count
+    int count = -1;
+    CHECK(printf_both(bf, expected, &length, "ab%ncd|", &count) == 0 && count == 2);
+
+    // Records longer than the buffer, and than the stack space for them, are formatted aside
+    static char text[3000];
+    memset(text, 't', sizeof(text) - 1);
+    CHECK(printf_both(bf, expected, &length, "[%s]", text) == 0);
+    CHECK(printf_both(bf, expected, &length, "[%300d]", 5) == 0);
+    CHECK(buffered_close(bf) == 0);
+
+    static char buf[sizeof(expected)];
+    CHECK(read_file(path, buf, sizeof(buf)) == (ssize_t) length && memcmp(buf, expected, length) == 0);
+
+    bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    CHECK(buffered_printf(bf, "%d", 1) == -1 && errno == EBADF);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+// Bitwise CRC32C, the reference the library's kernels are checked against
+static uint32_t reference_crc32c(const unsigned char *data, size_t length) {
+    uint32_t crc = ~0u;
+    while (length--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+    }
+    return ~crc;
+}
+
+static int test_checksum(void) {
+    const char *path = scratch_path("checksum");
+    buffered_open_options_t opts = {0};
+    opts.checksum = 1;
+
+    // The CRC32C check value
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "123456789", 9) == 9);
+    CHECK(buffered_checksum(bf) == 0xE3069283u);
+    CHECK(buffered_close(bf) == 0);
+
+    // Pieces of many lengths starting at odd addresses, so the kernel runs at every alignment and goes
+    // through both its word loop and its tail
+    static unsigned char data[100003];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char) (i * 131 + i / 7);
+    static const size_t pieces[] = {1, 7, 13, 4099, 3, 65537, 31};
+    bf = buffered_open_ex(path, O_WRONLY | O_TRUNC, 0, &opts);
+    CHECK(bf);
+    size_t done = 0;
+    for (size_t i = 0; done < sizeof(data) - 3; i++) {
+        size_t length = pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+        if (length > sizeof(data) - 3 - done)
+            length = sizeof(data) - 3 - done;
+        CHECK(buffered_write(bf, data + 3 + done, length) == (ssize_t) length);
+        done += length;
+    }
+    uint32_t expected = reference_crc32c(data + 3, sizeof(data) - 3);
+    CHECK(buffered_checksum(bf) == expected);
+    CHECK(buffered_close(bf) == 0);
+
+    // Reading the file back gives the same value, without the option there is none
+    bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    CHECK(bf);
+    static char buf[4099];
+    ssize_t read_bytes;
+    while ((read_bytes = buffered_read(bf, buf, sizeof(buf))) > 0)
+        ;
+    CHECK(read_bytes == 0 && buffered_checksum(bf) == expected);
+    CHECK(buffered_close(bf) == 0);
+    bf = buffered_open(path, O_RDONLY);
+    CHECK(bf);
+    CHECK(buffered_read(bf, buf, sizeof(buf)) == (ssize_t) sizeof(buf) && buffered_checksum(bf) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_group_commit(void) {
+    const char *path = scratch_path("group");
+    buffered_open_options_t opts = {0};
+    opts.durability = BUFFER_DURABILITY_GROUP;
+    opts.sync_interval_ms = 20;
+    opts.stats = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+
+    // A flush after the period has ended syncs what was written before it
+    CHECK(buffered_write(bf, "record\n", 7) == 7);
+    CHECK(buffered_flush(bf) == 0);
+    sleep_ms(50);
+    CHECK(buffered_write(bf, "record\n", 7) == 7);
+    CHECK(buffered_flush(bf) == 0);
+    buffered_stats_t stats;
+    CHECK(buffered_stats(bf, &stats) == 0);
+    CHECK(stats.syncs >= 1);
+
+    // Data flushed and then left alone is synced when the period ends
+    uint64_t syncs = stats.syncs;
+    CHECK(buffered_write(bf, "record\n", 7) == 7);
+    CHECK(buffered_flush(bf) == 0);
+    sleep_ms(200);
+    CHECK(buffered_stats(bf, &stats) == 0);
+    CHECK(stats.syncs > syncs);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static int test_prepend_log(void) {
+    const char *path = scratch_path("log");
+    char log_path[160];
+    snprintf(log_path, sizeof(log_path), "%s%s", path, BUFFER_PREFIX_SUFFIX);
+    CHECK(write_file(path, "BASE\n", 5) == 0);
+
+    // Handles that would address the file's own bytes instead of the logical file are refused
+    buffered_open_options_t opts = {0};
+    opts.prepend_log = 1;
+    CHECK(!buffered_open_ex(path, O_RDWR | O_PREAPPEND, 0, &opts) && errno == EINVAL);
+    CHECK(!buffered_open_ex(path, O_WRONLY, 0, &opts) && errno == EINVAL);
+
+    // Each handle is a generation, the newest one comes first
+    buffered_file_t *bf = buffered_open_ex(path, O_WRONLY | O_PREAPPEND, 0, &opts);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "one ", 4) == 4);
+    CHECK(buffered_close(bf) == 0);
+    bf = buffered_open_ex(path, O_WRONLY | O_PREAPPEND, 0, &opts);
+    CHECK(bf);
+    CHECK(buffered_write(bf, "zero ", 5) == 5);
+    CHECK(buffered_close(bf) == 0);
+
+    char buf[64];
+    CHECK(read_file(path, buf, sizeof(buf)) == 5);
+    CHECK(read_handle(path, &opts, buf, sizeof(buf)) == 14);
+    CHECK(memcmp(buf, "zero one BASE\n", 14) == 0);
+
+    bf = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    CHECK(bf);
+    CHECK(buffered_pread(bf, buf, 6, 7) == 6 && memcmp(buf, "e BASE", 6) == 0);
+    CHECK(buffered_lseek(bf, 0, SEEK_END) == 14);
+    CHECK(buffered_close(bf) == 0);
+
+    CHECK(buffered_compact(path) == 0);
+    CHECK(access(log_path, F_OK) == -1);
+    CHECK(read_file(path, buf, sizeof(buf)) == 14 && memcmp(buf, "zero one BASE\n", 14) == 0);
+
+    // A sidecar that is not the file's log is never overwritten or removed
+    CHECK(write_file(log_path, "foreign", 7) == 0);
+    CHECK(!buffered_open_ex(path, O_WRONLY | O_PREAPPEND, 0, &opts) && errno == EEXIST);
+    bf = buffered_open_ex(path, O_WRONLY | O_TRUNC, 0, &opts);
+    CHECK(bf);
+    CHECK(buffered_close(bf) == 0);
+    CHECK(read_file(log_path, buf, sizeof(buf)) == 7 && memcmp(buf, "foreign", 7) == 0);
+    return 0;
+}
+
+static int test_copy(void) {
+    const char *src_path = scratch_path("copy_src");
+    const char *dst_path = scratch_path("copy_dst");
+    static char data[300000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 3 + i / 777);
+    CHECK(write_file(src_path, data, sizeof(data)) == 0);
+
+    buffered_file_t *src = buffered_open(src_path, O_RDONLY);
+    buffered_file_t *dst = buffered_open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(src && dst);
+    char buf[100];
+    CHECK(buffered_read(src, buf, sizeof(buf)) == (ssize_t) sizeof(buf));
+    CHECK(buffered_write(dst, "X", 1) == 1);
+    CHECK(buffered_copy(dst, src, (size_t) -1) == (ssize_t) sizeof(data) - 100);
+    CHECK(buffered_copy(dst, dst, 1) == -1 && errno == EINVAL);
+    CHECK(buffered_close(src) == 0);
+    CHECK(buffered_close(dst) == 0);
+
+    static char out[300000];
+    CHECK(read_file(dst_path, out, sizeof(out)) == (ssize_t) sizeof(data) - 99);
+    CHECK(out[0] == 'X' && memcmp(out + 1, data + 100, sizeof(data) - 100) == 0);
+    return 0;
+}
+
+static int test_block_cache(void) {
+    const char *path = scratch_path("cache");
+    static char data[100000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char) (i * 7 + i / 1000);
+    CHECK(write_file(path, data, sizeof(data)) == 0);
+    CHECK(buffered_cache_configure(1 << 20) == 0);
+
+    buffered_open_options_t opts = {0};
+    opts.block_cache = 1;
+    opts.stats = 1;
+    buffered_file_t *first = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    buffered_file_t *second = buffered_open_ex(path, O_RDONLY, 0, &opts);
+    CHECK(first && second);
+
+    // The second handle finds the blocks the first one loaded
+    char buf[1000];
+    CHECK(buffered_read(first, buf, sizeof(buf)) == (ssize_t) sizeof(buf) && memcmp(buf, data, sizeof(buf)) == 0);
+    CHECK(buffered_read(second, buf, sizeof(buf)) == (ssize_t) sizeof(buf) && memcmp(buf, data, sizeof(buf)) == 0);
+    buffered_stats_t stats;
+    CHECK(buffered_stats(second, &stats) == 0);
+    CHECK(stats.cache_hits > 0 && stats.cache_misses == 0);
+
+    // A write through another handle drops the cached blocks, cached readers load the new data (data
+    // already in a reader's own window stays as it was, like with any buffered reader)
+    CHECK(buffered_pread(second, buf, 10, 50098) == 10 && memcmp(buf, data + 50098, 10) == 0);
+    buffered_file_t *writer = buffered_open(path, O_WRONLY);
+    CHECK(writer);
+    CHECK(buffered_lseek(writer, 50100, SEEK_SET) == 50100);
+    CHECK(buffered_write(writer, "HELLO", 5) == 5);
+    CHECK(buffered_close(writer) == 0);
+    CHECK(buffered_pread(second, buf, 10, 50098) == 10);
+    CHECK(memcmp(buf, data + 50098, 2) == 0 && memcmp(buf + 2, "HELLO", 5) == 0);
+
+    CHECK(buffered_close(first) == 0);
+    CHECK(buffered_close(second) == 0);
+    return 0;
+}
+
+static int test_autoflush(void) {
+    const char *path = scratch_path("autoflush");
+    buffered_open_options_t opts = {0};
+    opts.flush_latency_us = 2000;
+    opts.stats = 1;
+    buffered_file_t *bf = buffered_open_ex(path, O_RDWR | O_CREAT | O_TRUNC, 0644, &opts);
+    CHECK(bf);
+
+    // The timer hands idle data to the kernel without another call
+    CHECK(buffered_write(bf, "one\ntwo\n", 8) == 8);
+    CHECK(file_size(path) == 0);
+    sleep_ms(50);
+    CHECK(file_size(path) == 8);
+    buffered_stats_t stats;
+    CHECK(buffered_stats(bf, &stats) == 0);
+    CHECK(stats.auto_flushes >= 1);
+
+    // Calls that go through other internal helpers keep working under the handle's lock
+    CHECK(buffered_lseek(bf, 0, SEEK_SET) == 0);
+    char line[16];
+    CHECK(buffered_readline(bf, line, sizeof(line)) == 4 && memcmp(line, "one\n", 4) == 0);
+    CHECK(buffered_readline(bf, line, sizeof(line)) == 4 && memcmp(line, "two\n", 4) == 0);
+    CHECK(buffered_close(bf) == 0);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"auto_size", test_auto_size},
+    {"prepend_in_place", test_prepend_in_place},
+    {"prepend_atomic", test_prepend_atomic},
+    {"mmap", test_mmap},
+    {"write_behind", test_write_behind},
+    {"readahead", test_readahead},
+    {"peek", test_peek},
+    {"readline", test_readline},
+    {"positional", test_positional},
+    {"pool", test_pool},
+    {"direct", test_direct},
+    {"coherent", test_coherent},
+    {"coherent_threads", test_coherent_threads},
+    {"vectored", test_vectored},
+    {"stats", test_stats},
+    {"printf", test_printf},
+    {"checksum", test_checksum},
+    {"group_commit", test_group_commit},
+    {"prepend_log", test_prepend_log},
+    {"copy", test_copy},
+    {"block_cache", test_block_cache},
+    {"autoflush", test_autoflush},
+};
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+    snprintf(scratch, sizeof(scratch), "test_buffered.XXXXXX");
+    if (!mkdtemp(scratch)) {
+        perror("Failed to create scratch directory");
+        return 1;
+    }
+
+    // A deadlock fails the run instead of hanging it
+    alarm(60);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int selected = argc == 1;
+        for (int arg = 1; arg < argc; arg++)
+            selected |= strcmp(argv[arg], tests[i].name) == 0;
+        if (!selected)
+            continue;
+        int result = tests[i].run();
+        printf("%s: %s\n", tests[i].name, result == 0 ? "ok" : "FAILED");
+        failed |= result != 0;
+    }
+
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return failed;
+}
@@ -0,0 +1,271 @@
+#include "buffered_file.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ftw.h>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unistd.h>
+
+// Behaviour checks for the C++ layer in buffered_file.hpp, laid out like test_buffered.c.
+// Usage: test_buffered_file [test ...], all tests by default
+
+using namespace fileops;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+static char scratch[64];
+
+static std::string scratch_path(const char *name) {
+    return std::string(scratch) + "/" + name;
+}
+
+// Read a whole file with plain stdio
+static std::string read_file(const std::string &path) {
+    std::string data;
+    FILE *file = std::fopen(path.c_str(), "r");
+    if (!file)
+        return data;
+    char buf[4096];
+    std::size_t length;
+    while ((length = std::fread(buf, 1, sizeof(buf), file)) > 0)
+        data.append(buf, length);
+    std::fclose(file);
+    return data;
+}
+
+static int test_file(void) {
+    std::string path = scratch_path("file");
+    std::error_code ec;
+
+    BufferedFile missing = BufferedFile::open(path.c_str(), O_RDONLY, ec);
+    CHECK(!missing && ec == std::errc::no_such_file_or_directory);
+
+    BufferedFile file = BufferedFile::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, ec);
+    CHECK(file && !ec);
+    CHECK(file.write("hello world\n", ec) == 12 && !ec);
+    CHECK(file.pwrite(std::as_bytes(std::span("W", 1)), 6, ec) == 1 && !ec);
+
+    // Moving hands the handle over, the moved-from object is empty
+    BufferedFile moved = std::move(file);
+    CHECK(!file && moved);
+    CHECK(moved.seek(0, SEEK_SET, ec) == 0 && !ec);
+    std::byte buf[16];
+    CHECK(moved.read(buf, ec) == 12 && !ec && std::memcmp(buf, "hello World\n", 12) == 0);
+    CHECK(moved.read(buf, ec) == 0 && !ec);
+
+    CHECK(moved.seek(0, SEEK_SET, ec) == 0);
+    std::span<const char> view = moved.peek(5, ec);
+    CHECK(!ec && view.size() >= 5 && std::memcmp(view.data(), "hello", 5) == 0);
+    moved.consume(6, ec);
+    CHECK(!ec);
+    CHECK(moved.read_until('\n', buf, ec) == 6 && std::memcmp(buf, "World\n", 6) == 0);
+    moved.consume(1, ec);
+    CHECK(ec == std::errc::invalid_argument);
+
+    moved.close(ec);
+    CHECK(!ec && !moved);
+    CHECK(read_file(path) == "hello World\n");
+    return 0;
+}
+
+static int test_streambuf(void) {
+    std::string path = scratch_path("streambuf");
+    std::error_code ec;
+
+    // Insertions go through buffered_write
+    BufferedFile file = BufferedFile::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, ec);
+    CHECK(file);
+    {
+        BufferedStreambuf buf(file);
+        std::ostream out(&buf);
+        out << "first line\n" << 42 << ' ' << 3.5 << '\n';
+        for (int i = 0; i < 1000; i++)
+            out << "line " << i << '\n';
+        out.flush();
+        CHECK(out.good());
+    }
+    file.close(ec);
+    CHECK(!ec);
+
+    // Extraction reads the handle's buffer in place, getline included
+    file = BufferedFile::open(path.c_str(), O_RDONLY, ec);
+    CHECK(file);
+    {
+        BufferedStreambuf buf(file);
+        std::istream in(&buf);
+        std::string line;
+        CHECK(std::getline(in, line) && line == "first line");
+        int number = 0;
+        double real = 0;
+        CHECK(in >> number >> real && number == 42 && real == 3.5);
+        CHECK(in.get() == '\n');
+        CHECK(in.rdbuf()->in_avail() > 0);
+        for (int i = 0; i < 500; i++)
+            CHECK(std::getline(in, line) && line == "line " + std::to_string(i));
+    }
+
+    // The handle continues where the stream stopped
+    std::byte rest[16];
+    CHECK(file.read_until('\n', rest, ec) == 9 && std::memcmp(rest, "line 500\n", 9) == 0);
+    {
+        BufferedStreambuf buf(file);
+        std::istream in(&buf);
+        std::string line, last;
+        int lines = 0;
+        while (std::getline(in, line)) {
+            last = line;
+            lines++;
+        }
+        CHECK(lines == 499 && last == "line 999");
+        CHECK(in.rdbuf()->in_avail() == 0);
+    }
+    file.close(ec);
+    CHECK(!ec);
+    return 0;
+}
+
+// Write records through a WriteOnly or Prepend file with the given policy, then read them back
+template <Access Mode, Durability Policy>
+static int check_writer(const char *name, const buffered_open_options_t *opts) {
+    std::string path = scratch_path(name);
+    std::error_code ec;
+    {
+        FILE *base = std::fopen(path.c_str(), "w");
+        CHECK(base && std::fputs("base\n", base) >= 0 && std::fclose(base) == 0);
+    }
+
+    auto file = StaticBufferedFile<64, Mode, Policy>::open(path.c_str(), Mode == Access::Prepend ? 0 : O_APPEND, 0,
+                                                           ec, opts);
+    CHECK(file && !ec);
+    std::string expected;
+    for (int i = 0; i < 100; i++) {
+        std::string record = "record " + std::to_string(i) + "\n";
+        CHECK(file.write(record, ec) == record.size() && !ec);
+        expected += record;
+    }
+    // A piece larger than the buffer goes to the C handle together with what is buffered
+    std::string large(200, 'x');
+    large += '\n';
+    CHECK(file.write(large, ec) == large.size() && !ec);
+    expected += large;
+    file.flush(ec);
+    CHECK(!ec);
+    CHECK(file.write(std::string_view("last\n"), ec) == 5);
+    expected += "last\n";
+    file.close(ec);
+    CHECK(!ec && !file);
+    expected = Mode == Access::Prepend ? expected + "base\n" : "base\n" + expected;
+
+    // Prefix logs are read back through a log-mode handle, everything else through a ReadOnly file
+    std::string contents;
+    if (opts && opts->prepend_log) {
+        buffered_file_t *bf = buffered_open_ex(path.c_str(), O_RDONLY, 0, opts);
+        CHECK(bf);
+        char buf[4096];
+        ssize_t length;
+        while ((length = buffered_read(bf, buf, sizeof(buf))) > 0)
+            contents.append(buf, static_cast<std::size_t>(length));
+        CHECK(buffered_close(bf) == 0);
+        CHECK(read_file(path) == "base\n");
+    } else {
+        auto reader = StaticBufferedFile<32, Access::ReadOnly>::open(path.c_str(), 0, 0, ec);
+        CHECK(reader && !ec);
+        std::byte buf[7];
+        std::size_t length;
+        while ((length = reader.read(buf, ec)) > 0)
+            contents.append(reinterpret_cast<const char *>(buf), length);
+        CHECK(!ec);
+    }
+    CHECK(contents == expected);
+    return 0;
+}
+
+static int test_static(void) {
+    // Every access mode with every durability policy it allows
+    CHECK((check_writer<Access::WriteOnly, Durability::None>("static_w_none", nullptr)) == 0);
+    CHECK((check_writer<Access::WriteOnly, Durability::Flush>("static_w_flush", nullptr)) == 0);
+    CHECK((check_writer<Access::WriteOnly, Durability::Group>("static_w_group", nullptr)) == 0);
+    CHECK((check_writer<Access::WriteOnly, Durability::Writeback>("static_w_writeback", nullptr)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::None>("static_p_none", nullptr)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Flush>("static_p_flush", nullptr)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Group>("static_p_group", nullptr)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Writeback>("static_p_writeback", nullptr)) == 0);
+
+    buffered_open_options_t opts{};
+    opts.prepend_log = 1;
+    CHECK((check_writer<Access::Prepend, Durability::None>("static_log_none", &opts)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Flush>("static_log_flush", &opts)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Group>("static_log_group", &opts)) == 0);
+    CHECK((check_writer<Access::Prepend, Durability::Writeback>("static_log_writeback", &opts)) == 0);
+
+    // Options the C handle would apply to an empty buffer are refused
+    std::string path = scratch_path("static_w_none");
+    std::error_code ec;
+    opts = {};
+    opts.flush_latency_us = 1000;
+    CHECK(!(StaticBufferedFile<64, Access::WriteOnly>::open(path.c_str(), 0, 0, ec, &opts)));
+    CHECK(ec == std::errc::invalid_argument);
+    opts = {};
+    opts.write_behind_buffers = 2;
+    CHECK(!(StaticBufferedFile<64, Access::WriteOnly>::open(path.c_str(), 0, 0, ec, &opts)));
+    CHECK(ec == std::errc::invalid_argument);
+
+    // Moving a reader carries what it has buffered
+    auto reader = StaticBufferedFile<16, Access::ReadOnly>::open(path.c_str(), 0, 0, ec);
+    CHECK(reader);
+    std::byte buf[5];
+    CHECK(reader.read(buf, ec) == 5 && std::memcmp(buf, "base\n", 5) == 0);
+    auto moved = std::move(reader);
+    CHECK(!reader && moved);
+    CHECK(moved.read(buf, ec) == 5 && std::memcmp(buf, "recor", 5) == 0);
+    moved.close(ec);
+    CHECK(!ec);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"file", test_file},
+    {"streambuf", test_streambuf},
+    {"static", test_static},
+};
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return std::remove(path);
+}
+
+int main(int argc, char *argv[]) {
+    std::snprintf(scratch, sizeof(scratch), "test_buffered_file.XXXXXX");
+    if (!mkdtemp(scratch)) {
+        std::perror("Failed to create scratch directory");
+        return 1;
+    }
+
+    // A deadlock fails the run instead of hanging it
+    alarm(60);
+
+    int failed = 0;
+    for (const auto &test : tests) {
+        bool selected = argc == 1;
+        for (int arg = 1; arg < argc; arg++)
+            selected |= std::strcmp(argv[arg], test.name) == 0;
+        if (!selected)
+            continue;
+        int result = test.run();
+        std::printf("%s: %s\n", test.name, result == 0 ? "ok" : "FAILED");
+        failed |= result != 0;
+    }
+
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return failed;
+}